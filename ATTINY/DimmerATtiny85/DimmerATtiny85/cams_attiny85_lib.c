@@ -6,6 +6,7 @@
  */ 
 
 #include "cams_attiny85_lib.h"
+#include <util/delay.h>
 
 // ============== Clock ==============
 
@@ -26,7 +27,7 @@ uint32_t getSystemClockHz(void)
 
 void calibrateClockTest(void)
 {
-    overclock();                    // This value is that value to be calibrated. Get it as close as possible to 10Mhz with PLL enabled.
+    OSCCAL = OSCCAL_DEFAULT;        // This value is that value to be calibrated. Get it as close as possible to 10Mhz with PLL enabled.
     TCCR1 = _BV(CTC1) | _BV(CS10);  // CTC mode, /1
     GTCCR = _BV(COM1B0);            // Toggle OC1B
     PLLCSR = 0<<PCKE;               // System clock as clock source
@@ -34,9 +35,60 @@ void calibrateClockTest(void)
     setPinOutput(PB4);
 }
 
+uint8_t osccal_factory = 0;         // OSCCAL as loaded at reset, the factory calibration for 8MHz
+
+/*
+ * Over-clocks the system clock to 20MHz, using the OSCCAL stored by the mains calibration if there is one (0 if not)
+ */
+void overclock(uint8_t stored_cal)
+{
+    osccal_factory = OSCCAL;
+    if(stored_cal >= OSCCAL_MIN){
+        OSCCAL = stored_cal;
+    }else{
+        OSCCAL = OSCCAL_DEFAULT;    // Not calibrated yet
+    }
+}
+
+// Moves OSCCAL a count at a time (under 1%), the datasheet warns against changing the clock more than 2% at once
+static void stepOscCal(uint8_t cal)
+{
+    while(OSCCAL != cal)
+    {
+        OSCCAL = (OSCCAL < cal) ? OSCCAL + 1 : OSCCAL - 1;
+        _delay_us(8);               // Lets the PLL follow
+    }
+}
+
+/*
+ * The EEPROM write is timed from the RC oscillator and can fail with it calibrated above 8.8MHz, so it goes back to
+ * the factory 8MHz value for a write (16MHz system clock, 64MHz timer 1). Both timers slow down with it, the caller
+ * holds off the gates meanwhile. Going from the upper OSCCAL range into the lower one can't be done in small steps,
+ * it is the same jump overclock() makes the other way at every boot. Returns the value for eepromClockUp().
+ */
+uint8_t eepromClockDown(void)
+{
+    uint8_t cal = OSCCAL;
+    
+    stepOscCal(osccal_factory);
+    return cal;
+}
+
+/*
+ * Back to the running calibration once the EEPROM write is done
+ */
+void eepromClockUp(uint8_t cal)
+{
+    stepOscCal(cal);
+}
+
 // ============= Watchdog ============
+
+uint8_t reset_cause = 0;            // MCUSR as it was at boot
+
 void watchdogSetup(void)
 {
+    reset_cause = MCUSR;            // Keep the reset flags (PORF, EXTRF, BORF, WDRF) before they are cleared
     MCUSR = 0x00;                   // NB. MCUSR must be zeroed or watchdog will keep rebooting
     WDTCR |= (1<<WDCE)|(1<<WDE);
     WDTCR = 0x00;                   // disable watchdog
@@ -50,96 +102,343 @@ void feedWatchdog(void)
     WDTCR |= (1<<WDIE);             // feed the watchdog
 }
 
+uint8_t getResetCause(void)
+{
+    return reset_cause;
+}
+
 ISR(WDT_vect) { WDTCR |= (1<<WDE);} // reset WDE (but don't reset "WDIE" here, only do that in main loop as the "feed watchdog" command)
                                     // ie. if WDIE not set in main loop, then next trigger of WDE will re-boot the ATTiny instead of calling this ISR
 
 // ============== Timer ==============
 
-InterruptFunction INT_FUNC_tim0_OCA = NULL;
-InterruptFunction INT_FUNC_tim0_OCB = NULL;
-InterruptFunction INT_FUNC_tim1_OCA = NULL;
-InterruptFunction INT_FUNC_tim1_OCB = NULL;
+// Both timers are only 8 bit, so a compare value is extended in software: the high byte is the
+// overflow period the compare is due in and the low byte goes to the OCR. The compare interrupt is
+// only armed once its overflow period has started, so it fires once per ResetAllCounters().
+
+#define TIM_CHANNELS    4
 
-void InitialiseTimer(TIMx_e timer, InterruptFunction attach_interrupt)
+// The TIMSK enable bits and the TIFR flag bits share the same positions
+static const uint8_t tim_compare_mask[TIM_CHANNELS] = {_BV(OCIE0A), _BV(OCIE0B), _BV(OCIE1A), _BV(OCIE1B)};
+
+InterruptFunction INT_FUNC_tim[TIM_CHANNELS] = {NULL};
+uint8_t tim_num[TIM_CHANNELS] = {0};            // Passed back to the interrupt function
+uint8_t tim_compare_ovf[TIM_CHANNELS] = {0};    // Overflow period each compare is due in
+uint8_t tim_output_armed = 0;                   // Pin mask of the compare outputs to raise at their next match
+volatile uint8_t tim0_ovf_count = 0;
+volatile uint8_t tim1_ovf_count = 0;
+
+void InitialiseTimer(TIMx_e timer, InterruptFunction attach_interrupt, uint8_t num)
 {
-    // Unique things
-    switch(timer)
-    {
-        case TIM0_A:
-            INT_FUNC_tim0_OCA = attach_interrupt;
-            // enable compare interrupt
-            TIMSK |= _BV(OCIE0A);
-            break;
-        case TIM0_B:
-            INT_FUNC_tim0_OCB = attach_interrupt;
-            // enable compare interrupt
-            TIMSK |= _BV(OCIE0B);
-            break;
-        case TIM1_A:
-            INT_FUNC_tim1_OCA = attach_interrupt;
-            // enable compare interrupt
-            TIMSK |= _BV(OCIE1A);
-            break;
-        case TIM1_B:
-            INT_FUNC_tim1_OCB = attach_interrupt;
-            // enable compare interrupt
-            TIMSK |= _BV(OCIE1B);
-            break;
-        default:
-            break;
+    if(timer >= TIM_CHANNELS){
+        return;
     }
     
+    INT_FUNC_tim[timer] = attach_interrupt;
+    tim_num[timer] = num;
+    
     // Common things
     switch(timer)
     {
         case TIM0_A:
         case TIM0_B:
             // set prescaler and start timer
-            TCCR0B |= TIM0_PSC_1024;
+            TCCR0B = (TCCR0B & ~0x07) | TIM0_CLK_SELECT;
             // initialize counter
             TCNT0 = 0;
+            // enable overflow interrupt, the compares get armed from there
+            TIMSK |= _BV(TOIE0);
             break;
         case TIM1_A:
         case TIM1_B:
+            // clock timer 1 from the PLL
+            if(!(PLLCSR & _BV(PCKE)))
+            {
+                PLLCSR |= _BV(PLLE);                // Already running if the PLL is the system clock source
+                _delay_us(100);                     // PLOCK is not valid until the PLL had time to start
+                while(!(PLLCSR & _BV(PLOCK)));
+                PLLCSR |= _BV(PCKE);
+            }
             // set prescaler and start timer
-            TCCR1 |= TIM1_PSC_1024;
+            TCCR1 = (TCCR1 & ~0x0F) | TIM1_CLK_SELECT;
             // initialize counter
             TCNT1 = 0;
+            // enable overflow interrupt, the compares get armed from there
+            TIMSK |= _BV(TOIE1);
             break;
         default:
             break;
     }
 }
 
-void SetTimerCompare(TIMx_e timer, uint8_t compare_value)
+/*
+ * Swaps the interrupt function of a running channel. NULL frees the compare, it is no longer armed.
+ * Call with interrupts off.
+ */
+void AttachTimerInterrupt(TIMx_e timer, InterruptFunction attach_interrupt, uint8_t num)
+{
+    if(timer >= TIM_CHANNELS){
+        return;
+    }
+    
+    INT_FUNC_tim[timer] = attach_interrupt;
+    tim_num[timer] = num;
+    if(attach_interrupt == NULL){
+        TIMSK &= ~tim_compare_mask[timer];
+    }
+}
+
+void SetTimerCompare(TIMx_e timer, uint16_t compare_value)
 {
+    uint8_t compare_low = (uint8_t)compare_value;
+    
     switch(timer)
     {
-        case TIM0_A: OCR0A = compare_value; break;
-        case TIM0_B: OCR0B = compare_value; break;
-        case TIM1_A: OCR1A = compare_value; break;
-        case TIM1_B: OCR1B = compare_value; break;
+        case TIM0_A: OCR0A = compare_low; break;
+        case TIM0_B: OCR0B = compare_low; break;
+        case TIM1_A: OCR1A = compare_low; break;
+        case TIM1_B: OCR1B = compare_low; break;
+        default: return;
+    }
+    tim_compare_ovf[timer] = (uint8_t)(compare_value >> 8);
+}
+
+/*
+ * Extended count (overflow period and counter) since the last ResetAllCounters(). Call with interrupts off.
+ */
+uint16_t GetTimerCount(TIMx_e timer)
+{
+    uint8_t ovf, count;
+    
+    if(timer < TIM1_A)
+    {
+        ovf = tim0_ovf_count;
+        count = TCNT0;
+        if((TIFR & _BV(TOV0)) && (count < 0x80)){
+            ovf++;                  // Wrapped, but the overflow ISR hasn't had its turn yet
+        }
+    }
+    else
+    {
+        ovf = tim1_ovf_count;
+        count = TCNT1;
+        if((TIFR & _BV(TOV1)) && (count < 0x80)){
+            ovf++;
+        }
+    }
+    return ((uint16_t)ovf << 8) | count;
+}
+
+static inline uint8_t getTimerCount(TIMx_e timer)
+{
+    return (timer < TIM1_A) ? TCNT0 : TCNT1;
+}
+
+static inline uint8_t getTimerCompare(TIMx_e timer)
+{
+    switch(timer)
+    {
+        case TIM0_A: return OCR0A;
+        case TIM0_B: return OCR0B;
+        case TIM1_A: return OCR1A;
+        default: return OCR1B;
+    }
+}
+
+/*
+ * Hands a timer 1 channel's pin (OC1A = PB1, OC1B = PB4) over to the compare output.
+ * It idles in "clear on match" mode, so the pin stays low until ArmTimerOutputs() is called.
+ */
+void EnableTimerOutput(TIMx_e timer)
+{
+    switch(timer)
+    {
+        case TIM1_A: TCCR1 = (TCCR1 & ~(_BV(COM1A1) | _BV(COM1A0))) | _BV(COM1A1); break;
+        case TIM1_B: GTCCR = (GTCCR & ~(_BV(COM1B1) | _BV(COM1B0))) | _BV(COM1B1); break;
         default: break;
     }
 }
 
+/*
+ * The compare outputs in the pin mask get raised at their next compare match. Call before ResetAllCounters(), the
+ * outputs are switched to "set on match" when the compare is armed, at the start of its overflow period. If that
+ * comes too late (an ISR held it up past the match) the output is raised with a FOC strobe instead.
+ */
+void ArmTimerOutputs(uint8_t pin_mask)
+{
+    tim_output_armed = pin_mask & (_BV(OC1A_PIN) | _BV(OC1B_PIN));
+}
+
+/*
+ * Drives the connected compare outputs in the pin mask low straight away (PORTB has no say over them)
+ */
+void ResetTimerOutputs(uint8_t pin_mask)
+{
+    uint8_t strobe = 0;
+    
+    if((pin_mask & _BV(OC1A_PIN)) && (TCCR1 & _BV(COM1A1)))
+    {
+        TCCR1 &= ~_BV(COM1A0);          // Clear on match
+        strobe |= _BV(FOC1A);
+    }
+    if((pin_mask & _BV(OC1B_PIN)) && (GTCCR & _BV(COM1B1)))
+    {
+        GTCCR &= ~_BV(COM1B0);          // Clear on match
+        strobe |= _BV(FOC1B);
+    }
+    GTCCR |= strobe;                    // Force the compare action now
+}
+
+/*
+ * Drives the connected compare outputs in the pin mask high straight away, for gate pulses timed in software
+ */
+void SetTimerOutputs(uint8_t pin_mask)
+{
+    uint8_t strobe = 0;
+    
+    if((pin_mask & _BV(OC1A_PIN)) && (TCCR1 & _BV(COM1A1)))
+    {
+        TCCR1 |= _BV(COM1A0);           // Set on match
+        strobe |= _BV(FOC1A);
+    }
+    if((pin_mask & _BV(OC1B_PIN)) && (GTCCR & _BV(COM1B1)))
+    {
+        GTCCR |= _BV(COM1B0);           // Set on match
+        strobe |= _BV(FOC1B);
+    }
+    GTCCR |= strobe;                    // Force the compare action now
+}
+
+// Switches an armed compare output over to "set on match", returns the FOC bit to strobe it by hand
+static inline uint8_t setTimerOutput(TIMx_e timer)
+{
+    if(timer == TIM1_A && (tim_output_armed & _BV(OC1A_PIN)))
+    {
+        tim_output_armed &= ~_BV(OC1A_PIN);
+        TCCR1 |= _BV(COM1A0);
+        return _BV(FOC1A);
+    }
+    if(timer == TIM1_B && (tim_output_armed & _BV(OC1B_PIN)))
+    {
+        tim_output_armed &= ~_BV(OC1B_PIN);
+        GTCCR |= _BV(COM1B0);
+        return _BV(FOC1B);
+    }
+    return 0;
+}
+
+static inline void disarmCompare(TIMx_e timer)
+{
+    TIMSK &= ~tim_compare_mask[timer];
+}
+
+// Called (with interrupts off) at the start of the compare's overflow period
+static inline void armCompare(TIMx_e timer)
+{
+    uint8_t mask = tim_compare_mask[timer];
+    uint8_t strobe = setTimerOutput(timer);
+    
+    TIFR = mask;                                            // Drop the matches from earlier overflow periods
+    if(getTimerCount(timer) < getTimerCompare(timer))
+    {
+        TIMSK |= mask;
+    }
+    else
+    {
+        // Match already passed (this ISR was held up), so service it now rather than an overflow too late
+        GTCCR |= strobe;
+        TIFR = mask;
+        TIMSK &= ~mask;
+        INT_FUNC_tim[timer](tim_num[timer]);
+    }
+}
+
+static inline void armCompareIfDue(TIMx_e timer, uint8_t ovf_count)
+{
+    if(INT_FUNC_tim[timer] != NULL)
+    {
+        if(tim_compare_ovf[timer] == ovf_count){
+            armCompare(timer);
+        }else{
+            disarmCompare(timer);
+        }
+    }
+}
+
 void ResetAllCounters(void)
 {
+    GTCCR |= _BV(PSR0) | _BV(PSR1);     // Restart the prescalers too, so the first tick is a whole tick
     TCNT0 = 0;
     TCNT1 = 0;
+    TIFR = _BV(TOV0) | _BV(TOV1);       // Drop an overflow still pending from the last period
+    tim0_ovf_count = 0;
+    tim1_ovf_count = 0;
+    
+    armCompareIfDue(TIM0_A, 0);
+    armCompareIfDue(TIM0_B, 0);
+    armCompareIfDue(TIM1_A, 0);
+    armCompareIfDue(TIM1_B, 0);
+}
+
+/*
+ * Moves a compare on to a later point in the same half cycle, called from the compare's own handler.
+ * It is armed here if the new point falls in the current overflow period, otherwise by the overflow ISR.
+ */
+void ScheduleTimerCompare(TIMx_e timer, uint16_t compare_value)
+{
+    uint8_t ovf_count = (timer < TIM1_A) ? tim0_ovf_count : tim1_ovf_count;
+    
+    SetTimerCompare(timer, compare_value);
+    if(tim_compare_ovf[timer] == ovf_count){
+        armCompare(timer);
+    }
+}
+
+static inline void timerCompareMatch(TIMx_e timer)
+{
+    disarmCompare(timer);
+    if(INT_FUNC_tim[timer] != NULL){
+        INT_FUNC_tim[timer](tim_num[timer]);
+    }
 }
 
 //TIMER 0 COMPARE A match
-ISR (TIMER0_COMPA_vect){if(INT_FUNC_tim0_OCA != NULL){INT_FUNC_tim0_OCA(0);}}
+ISR (TIMER0_COMPA_vect){timerCompareMatch(TIM0_A);}
 
 //TIMER 0 COMPARE B match
-ISR (TIMER0_COMPB_vect){if(INT_FUNC_tim0_OCB != NULL){INT_FUNC_tim0_OCB(1);}}
+ISR (TIMER0_COMPB_vect){timerCompareMatch(TIM0_B);}
 
 //TIMER 1 COMPARE A match
-ISR (TIMER1_COMPA_vect){if(INT_FUNC_tim1_OCA != NULL){INT_FUNC_tim1_OCA(2);}}
+ISR (TIMER1_COMPA_vect){timerCompareMatch(TIM1_A);}
 
 //TIMER 1 COMPARE B match
-ISR (TIMER1_COMPB_vect){if(INT_FUNC_tim1_OCB != NULL){INT_FUNC_tim1_OCB(3);}}
+ISR (TIMER1_COMPB_vect){timerCompareMatch(TIM1_B);}
+
+//TIMER 0 overflow, saturates so a lost zero cross can't wrap around onto a compare
+ISR (TIMER0_OVF_vect)
+{
+    uint8_t count = tim0_ovf_count;
+    
+    if(count != 0xFF)
+    {
+        tim0_ovf_count = ++count;
+        armCompareIfDue(TIM0_A, count);
+        armCompareIfDue(TIM0_B, count);
+    }
+}
+
+//TIMER 1 overflow, saturates so a lost zero cross can't wrap around onto a compare
+ISR (TIMER1_OVF_vect)
+{
+    uint8_t count = tim1_ovf_count;
+    
+    if(count != 0xFF)
+    {
+        tim1_ovf_count = ++count;
+        armCompareIfDue(TIM1_A, count);
+        armCompareIfDue(TIM1_B, count);
+    }
+}
 
 
 // ============== Interrupts ==============
@@ -184,21 +483,6 @@ ISR(PCINT0_vect)
 
 // ============== GPIO ==============
 
-void setPinOutput(uint8_t pin)
-{
-    DDRB |= _BV(pin);
-}
-
-void setPin(uint8_t pin)
-{
-    PORTB |= _BV(pin);
-}
-
-void resetPin(uint8_t pin)
-{
-    PORTB = PINB & ~_BV(pin);
-}
-
 void pulsePin(uint8_t pin)
 {
     uint8_t j;
@@ -213,6 +497,7 @@ void pulsePin(uint8_t pin)
 #define I2C_SCL            PB2
 #define I2C_SDA            PB0
 #define I2C_ADDRESS        0x6A
+#define I2C_GENERAL_CALL   0x00    // Write only broadcast address, every dimmer on the bus takes these packets
 
 #define GET_USISIF              ((USISR & _BV(USISIF)) == _BV(USISIF))
 #define GET_USIOIF              ((USISR & _BV(USIOIF)) == _BV(USIOIF))
@@ -252,17 +537,28 @@ typedef enum{
     USI_SLAVE_CHECK_ADDRESS,
     USI_SLAVE_RECV_DATA_WAIT,
     USI_SLAVE_RECV_DATA_ACK_SEND,
+    USI_SLAVE_SEND_DATA,
+    USI_SLAVE_SEND_DATA_ACK_WAIT,
+    USI_SLAVE_SEND_DATA_ACK_CHECK,
     USI_SLAVE_NONE
 }I2C_state_e;
 
-#define DATA_BUF_LEN        4
-#define DATA_RECEIVED       1
-#define DATA_PENDING        0
-#define DATA_TERMINATED     -1
+// Received packets are queued by the ISR, so the main loop never has to wait on the bus
+#define I2C_RX_PACKETS      4       // Must be a power of 2
+#define I2C_TX_IDLE_BYTE    0xFF    // Sent once the master reads past the end of the transmit data
 
 I2C_state_e i2c_state;
-volatile int8_t i2c_data_received = DATA_TERMINATED;
-volatile uint8_t i2c_data = 0;
+volatile uint8_t i2c_rx_queue[I2C_RX_PACKETS][I2C_PACKET_SIZE];
+volatile uint8_t i2c_rx_head = 0;       // Written by the ISR
+volatile uint8_t i2c_rx_tail = 0;       // Written by i2c_receive_data()
+volatile uint8_t i2c_rx_count = 0;      // Bytes of the packet being received
+volatile uint8_t i2c_rx_dropped = 0;    // Packets lost to a full queue or a cut off transaction
+
+const volatile uint8_t * volatile i2c_tx_buf = NULL;
+volatile uint8_t i2c_tx_len = 0;
+uint8_t i2c_tx_index = 0;
+
+InterruptFunction INT_FUNC_i2c_packet = NULL;
 
 void i2c_init(void)
 {
@@ -285,7 +581,50 @@ ISR(USI_START_vect)
         USICR = I2C_STOP_DID_OCCUR_USICR;
     }
     USISR = I2C_CLR_START_USISR;
-    i2c_data_received = DATA_TERMINATED;
+    
+    if(i2c_rx_count != 0)
+    {
+        i2c_rx_count = 0;       // The last transaction stopped part way through a packet
+        i2c_rx_dropped++;
+    }
+}
+
+static inline void i2c_send_byte(void)
+{
+    uint8_t index = i2c_tx_index;
+    
+    if(index < i2c_tx_len){
+        USIDR = i2c_tx_buf[index];
+        i2c_tx_index = index + 1;
+    }else{
+        USIDR = I2C_TX_IDLE_BYTE;
+    }
+    i2c_state = USI_SLAVE_SEND_DATA_ACK_WAIT;
+    I2C_SET_SDA_OUTPUT()
+    USISR = I2C_BYTE_USISR;
+}
+
+static inline void i2c_store_byte(uint8_t data)
+{
+    uint8_t head = i2c_rx_head;
+    uint8_t count = i2c_rx_count;
+    
+    i2c_rx_queue[head][count++] = data;
+    
+    if(count == I2C_PACKET_SIZE)
+    {
+        if(INT_FUNC_i2c_packet != NULL){
+            INT_FUNC_i2c_packet(i2c_rx_queue[head][0]);
+        }
+        count = 0;
+        head = (head + 1) & (I2C_RX_PACKETS - 1);
+        if(head != i2c_rx_tail){
+            i2c_rx_head = head;
+        }else{
+            i2c_rx_dropped++;   // Queue full, this packet gets overwritten by the next one
+        }
+    }
+    i2c_rx_count = count;
 }
 
 ISR(USI_OVF_vect)
@@ -294,11 +633,14 @@ ISR(USI_OVF_vect)
     {
         case USI_SLAVE_CHECK_ADDRESS:
         {
-            //transmition_started = 1;
-            if((USIDR >> 1) == I2C_ADDRESS)
+            if(((USIDR >> 1) == I2C_ADDRESS) || (USIDR == (I2C_GENERAL_CALL << 1)))
             {
-                i2c_data_received = DATA_PENDING;
-                i2c_state = USI_SLAVE_RECV_DATA_WAIT;
+                if(USIDR & 0x01){
+                    i2c_state = USI_SLAVE_SEND_DATA;        // Master read
+                    i2c_tx_index = 0;
+                }else{
+                    i2c_state = USI_SLAVE_RECV_DATA_WAIT;   // Master write
+                }
 
                 //Set USI to send ACK
                 USIDR = 0;
@@ -316,35 +658,56 @@ ISR(USI_OVF_vect)
 
         case USI_SLAVE_RECV_DATA_WAIT:
         {
-            if(i2c_data_received == DATA_TERMINATED)
-            {
-                i2c_init();
-                i2c_state = USI_SLAVE_NONE;
-                return;
-            }
             i2c_state = USI_SLAVE_RECV_DATA_ACK_SEND;
 
             I2C_SET_SDA_INPUT()
             USISR = I2C_BYTE_USISR;
-            //transmition_started = 0;
             break;
         }
         
         case USI_SLAVE_RECV_DATA_ACK_SEND:
         {
             i2c_state = USI_SLAVE_RECV_DATA_WAIT;
-            
-            if(i2c_data_received == DATA_PENDING)
-            {
-                i2c_data = USIDR;
-                i2c_data_received = DATA_RECEIVED;
-            }
+            i2c_store_byte(USIDR);
         
             USIDR = 0;
             I2C_SET_SDA_OUTPUT()
             USISR = I2C_ACK_USISR;
             break;
         }
+        
+        case USI_SLAVE_SEND_DATA:
+        {
+            i2c_send_byte();
+            break;
+        }
+        
+        case USI_SLAVE_SEND_DATA_ACK_WAIT:
+        {
+            // Release SDA and clock in the master's ACK/NACK
+            i2c_state = USI_SLAVE_SEND_DATA_ACK_CHECK;
+            USIDR = 0;
+            I2C_SET_SDA_INPUT()
+            USISR = I2C_ACK_USISR;
+            break;
+        }
+        
+        case USI_SLAVE_SEND_DATA_ACK_CHECK:
+        {
+            if(USIDR & 0x01)
+            {
+                // NACK, the master has read all it wants. Wait for the next Start Condition
+                i2c_state = USI_SLAVE_NONE;
+                USICR = I2C_SET_START_COND_USICR;
+                USISR = I2C_SET_START_USISR;
+            }
+            else
+            {
+                i2c_send_byte();
+            }
+            break;
+        }
+        
         case USI_SLAVE_NONE:
         {
             i2c_init();
@@ -352,27 +715,52 @@ ISR(USI_OVF_vect)
     }
 }
 
+/*
+ * Takes the oldest received packet off the queue. Never waits on the bus.
+ * Returns the number of bytes copied into buf (0 when nothing has been received).
+ */
 uint8_t i2c_receive_data(uint8_t * buf, uint8_t size)
 {
-    uint8_t offset = 0;
+    uint8_t offset;
+    uint8_t tail = i2c_rx_tail;
     
-    while(offset < size)
-    {
-        if(i2c_data_received == DATA_RECEIVED)
-        {
-            buf[offset++] = i2c_data;
-            i2c_data_received = DATA_PENDING;
-        }
-        else if (i2c_data_received == DATA_TERMINATED)
-        {
-            return offset;
-        }
+    if(tail == i2c_rx_head){
+        return 0;
     }
-    if(offset == size)
-    {
-        i2c_data_received = DATA_TERMINATED;
+    
+    size = (size < I2C_PACKET_SIZE) ? size : I2C_PACKET_SIZE;
+    for(offset = 0; offset < size; offset++){
+        buf[offset] = i2c_rx_queue[tail][offset];
     }
-    return offset;
+    i2c_rx_tail = (tail + 1) & (I2C_RX_PACKETS - 1);
+    
+    return size;
+}
+
+/*
+ * Sets what a master read gets back, starting from the first byte on each read.
+ * The buffer is read from the ISR, so it has to stay valid (and should only change between reads).
+ */
+void i2c_set_transmit_data(const volatile uint8_t * buf, uint8_t len)
+{
+    cli();
+    i2c_tx_buf = buf;
+    i2c_tx_len = len;
+    sei();
+}
+
+uint8_t i2c_get_dropped_packets(void)
+{
+    return i2c_rx_dropped;
+}
+
+/*
+ * Called from the ISR with the first byte of each packet as it completes (before it is queued), for anything that
+ * can't wait behind the queue. Keep it short, the bus is held until it returns.
+ */
+void i2c_attach_packet_interrupt(InterruptFunction attach_interrupt)
+{
+    INT_FUNC_i2c_packet = attach_interrupt;
 }
 
 
@@ -393,7 +781,7 @@ static void i2c_ack(void)
 {
     USIDR = 0;
     I2C_SET_SDA_OUTPUT()            // Set the direction to output
-    PORTB = PINB & ~_BV(I2C_SDA);   // Pull the SDA line low to send ACK
+    resetPin(I2C_SDA);              // Pull the SDA line low to send ACK
     USISR = I2C_ACK_USISR;          // Set counter to overflow in 1 clock
     while(GET_USIOIF==0);           // Wait for overflow
     I2C_SET_SDA_INPUT()             // Set the direction to input
@@ -415,9 +803,9 @@ uint8_t i2c_receive_data(uint8_t * buf, uint8_t size)
     // ================= Verify I2C Address =================
     
     while(GET_USIOIF==0);           // Wait for counter overflow
-    usi_data = USIDR>>1;            // Save Address
+    usi_data = USIDR;               // Save Address
     
-    if((usi_data) == I2C_ADDRESS)   // Verify I2C address
+    if(((usi_data >> 1) == I2C_ADDRESS) || (usi_data == (I2C_GENERAL_CALL << 1)))  // Verify I2C address (or a general call write)
     {
         i2c_ack();                  // Send acknowledge bit
     }
@@ -439,4 +827,19 @@ uint8_t i2c_receive_data(uint8_t * buf, uint8_t size)
     return len;
 }
 
+void i2c_set_transmit_data(const volatile uint8_t * buf, uint8_t len)
+{
+    // Master reads are only supported with I2C_INTERRUPT_BASED
+}
+
+uint8_t i2c_get_dropped_packets(void)
+{
+    return 0;
+}
+
+void i2c_attach_packet_interrupt(InterruptFunction attach_interrupt)
+{
+    // Packets are only seen as they are read with i2c_receive_data() without I2C_INTERRUPT_BASED
+}
+
 #endif
\ No newline at end of file
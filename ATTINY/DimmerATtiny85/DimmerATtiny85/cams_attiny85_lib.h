@@ -20,11 +20,23 @@ typedef char bool;
 
 #define SYS_CLK     20000000UL    // 20MHz (overclocked)
 #define F_CPU       20000000UL    // 20MHz (overclocked)
-#define PRESCALER   1024
+
+// Timer 0 runs from the system clock, Timer 1 from the PLL clock (PCK = 4 x system clock)
+#define TIM0_CLK            F_CPU           // 20MHz
+#define TIM0_PRESCALER      64
+#define TIM0_CLK_SELECT     TIM0_PSC_64
+#define TIM0_TICK_HZ        (TIM0_CLK / TIM0_PRESCALER)     // 312.5kHz -> 3.2us per tick
+
+#define TIM1_CLK            (4 * F_CPU)     // 80MHz (64MHz PLL, overclocked)
+#define TIM1_PRESCALER      128
+#define TIM1_CLK_SELECT     TIM1_PSC_128
+#define TIM1_TICK_HZ        (TIM1_CLK / TIM1_PRESCALER)     // 625kHz -> 1.6us per tick
 
 // ============== Clock ==============
 
-#define overclock() OSCCAL = 163
+#define OSCCAL_DEFAULT  163     // Hand calibrated (see Setup.txt), only used until a mains calibrated value is stored
+#define OSCCAL_MIN      128     // Stay in the upper of the two overlapping OSCCAL ranges
+#define OSCCAL_MAX      255
 
 typedef enum{
     CLK_PSC_1 = 0,
@@ -38,6 +50,10 @@ typedef enum{
     CLK_PSC_256,
 }CLK_PSC_e;
 
+// ============== EEPROM ==============
+#define EEPROM_ADDR_RESETS      ((void *)0x02)      // Reset counters, see reset_counts_t in main.c
+#define EEPROM_ADDR_STORE       0x20                // Record ring to the end of the EEPROM, see eeprom_store.c
+
 // ============= Watchdog ==============
 #define WDT_16ms    0x00
 #define WDT_32ms    0x01
@@ -50,6 +66,9 @@ typedef enum{
 #define WDT_4s      0x20
 #define WDT_8s      0x21
 
+// ============== I2C ==============
+#define I2C_PACKET_SIZE     2   // Bytes in each packet written by the master (excluding the address)
+
 
 // ============== Timer ==============
 typedef enum{
@@ -87,6 +106,10 @@ typedef enum{
     TIM1_PSC_16384,
 }TIM1_PSC_e;
 
+// Timer 1 compare output pins
+#define OC1A_PIN    PB1
+#define OC1B_PIN    PB4
+
 // TIM0 TCCR
 #define WGM_NORMAL  0x00
 #define WGM_PWM     0x01
@@ -97,19 +120,42 @@ typedef void (*InterruptFunction)(uint8_t num);
 void setupSystemClock(CLK_PSC_e prescaler);
 uint32_t getSystemClockHz(void);
 void calibrateClockTest(void);
+void overclock(uint8_t stored_cal);
+uint8_t eepromClockDown(void);
+void eepromClockUp(uint8_t cal);
 void watchdogSetup(void);
 void feedWatchdog(void);
-void InitialiseTimer(TIMx_e timer, InterruptFunction attach_interrupt);
-void SetTimerCompare(TIMx_e timer, uint8_t compare_value);
+uint8_t getResetCause(void);
+void InitialiseTimer(TIMx_e timer, InterruptFunction attach_interrupt, uint8_t num);
+void AttachTimerInterrupt(TIMx_e timer, InterruptFunction attach_interrupt, uint8_t num);
+void SetTimerCompare(TIMx_e timer, uint16_t compare_value);
+void ScheduleTimerCompare(TIMx_e timer, uint16_t compare_value);
+uint16_t GetTimerCount(TIMx_e timer);
+void EnableTimerOutput(TIMx_e timer);
+void ArmTimerOutputs(uint8_t pin_mask);
+void ResetTimerOutputs(uint8_t pin_mask);
+void SetTimerOutputs(uint8_t pin_mask);
 void ResetAllCounters(void);
 void initialiseExternalInterrupt(uint8_t pin, InterruptFunction attach_interrupt);
 void enableGlobalInterrupts(bool enable);
-void setPinOutput(uint8_t pin);
-void setPin(uint8_t pin);
-void resetPin(uint8_t pin);
 void pulsePin(uint8_t pin);
 void i2c_init(void);
 uint8_t i2c_receive_data(uint8_t * buf, uint8_t size);
+void i2c_set_transmit_data(const volatile uint8_t * buf, uint8_t len);
+uint8_t i2c_get_dropped_packets(void);
+void i2c_attach_packet_interrupt(InterruptFunction attach_interrupt);
 void plotValue(uint8_t val);
 
+// ============== GPIO ==============
+// Inlined, so with a constant pin each of these compiles down to a single sbi/cbi instruction.
+// They write PORTB only (never PINB), so the other outputs and the I2C lines are left alone.
+
+static inline void setPinOutput(uint8_t pin)  { DDRB  |=  _BV(pin); }
+static inline void setPin(uint8_t pin)        { PORTB |=  _BV(pin); }
+static inline void resetPin(uint8_t pin)      { PORTB &= ~_BV(pin); }
+
+// Batched writes, every pin in the mask changes with a single PORTB store
+static inline void setPins(uint8_t mask)      { PORTB |=  mask; }
+static inline void resetPins(uint8_t mask)    { PORTB &= ~mask; }
+
 #endif /* CAMS_ATTINY85_LIB_H_ */
\ No newline at end of file
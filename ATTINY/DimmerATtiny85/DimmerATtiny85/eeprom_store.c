@@ -0,0 +1,216 @@
+/*
+ * eeprom_store.c
+ *
+ * Each record is a whole new version of the settings: sequence number, store_data_t, CRC-8. They go round a ring of
+ * slots from EEPROM_ADDR_STORE to the end of the EEPROM, each into the slot after the newest, so every slot is only
+ * written once every RECORD_SLOTS changes. At boot the newest record whose CRC checks out is loaded. A write the
+ * supply cut short fails the check (its sequence number goes last), which leaves the record before it as the newest.
+ */
+
+#include "cams_attiny85_lib.h"
+#include "eeprom_store.h"
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+#include <string.h>
+
+#define RECORD_SIZE     (sizeof(store_data_t) + 2)
+#define RECORD_SLOTS    ((E2END + 1 - EEPROM_ADDR_STORE) / RECORD_SIZE)     // Under 128, for the sequence compare
+
+store_data_t store;
+static store_data_t committed;              // Data of the newest record
+static uint8_t newest_slot = RECORD_SLOTS - 1;
+static uint8_t newest_seq = 0xFF;
+static bool dirty = false;                  // store has changed since the last record was started
+static uint8_t commit_delay = 0;            // Zero crosses left before it is written
+static uint8_t last_half_cycle = 0;
+static uint8_t image[RECORD_SIZE];          // Record being written
+static uint8_t image_left = 0;              // Bytes of it still to write
+
+
+// Starts from 0xFF, so a slot of zeros (as well as a blank one) fails the check
+static uint8_t record_crc(const uint8_t * record)
+{
+    uint8_t crc = 0xFF;
+    uint8_t i;
+
+    for(i = 0; i < RECORD_SIZE - 1; i++){
+        crc = _crc8_ccitt_update(crc, record[i]);
+    }
+    return crc;
+}
+
+
+static uint8_t * slot_address(uint8_t slot)
+{
+    return (uint8_t *)(EEPROM_ADDR_STORE + slot * RECORD_SIZE);
+}
+
+
+/*
+ * Snapshots store into the next record, returns false if it matches the newest one (nothing to write)
+ */
+static bool record_start(void)
+{
+    dirty = false;
+    if(memcmp(&store, &committed, sizeof(store_data_t)) == 0){
+        return false;
+    }
+
+    image[0] = newest_seq + 1;
+    memcpy(&image[1], &store, sizeof(store_data_t));
+    image[RECORD_SIZE - 1] = record_crc(image);
+    image_left = RECORD_SIZE;
+    return true;
+}
+
+
+// Where the next byte of the record goes, the sequence number last
+static uint8_t next_offset(void)
+{
+    return (RECORD_SIZE + 1 - image_left) % RECORD_SIZE;
+}
+
+static uint8_t * next_address(void)
+{
+    return slot_address((newest_slot + 1) % RECORD_SLOTS) + next_offset();
+}
+
+// Moves on past the next byte, the record is the newest once the last one is done
+static void record_advance(void)
+{
+    if(--image_left == 0)
+    {
+        newest_slot = (newest_slot + 1) % RECORD_SLOTS;
+        newest_seq = image[0];
+        memcpy(&committed, &image[1], sizeof(store_data_t));
+    }
+}
+
+
+/*
+ * Writes the next byte of the record and waits for it (~3.4ms), at the factory clock (see eepromClockDown())
+ */
+static void record_write_next(void)
+{
+    uint8_t * address = next_address();
+    uint8_t value = image[next_offset()];
+    uint8_t cal;
+    
+    if(eeprom_read_byte(address) != value)
+    {
+        cal = eepromClockDown();
+        eeprom_write_byte(address, value);
+        eeprom_busy_wait();
+        eepromClockUp(cal);
+    }
+    record_advance();
+}
+
+
+/*
+ * Loads the newest record, or the defaults if there is none
+ */
+void store_init(void)
+{
+    uint8_t record[RECORD_SIZE];
+    bool found = false;
+    uint8_t slot;
+
+    for(slot = 0; slot < RECORD_SLOTS; slot++)
+    {
+        eeprom_read_block(record, slot_address(slot), RECORD_SIZE);
+        if(record[RECORD_SIZE - 1] != record_crc(record)){
+            continue;
+        }
+        if(!found || ((int8_t)(record[0] - newest_seq) > 0))
+        {
+            newest_slot = slot;
+            newest_seq = record[0];
+            memcpy(&committed, &record[1], sizeof(store_data_t));
+            found = true;
+        }
+    }
+
+    if(found)
+    {
+        store = committed;
+        return;
+    }
+
+    store.osccal = 0;
+    memset(store.groups, 0xFF, sizeof(store.groups));   // In every group, as a blank EEPROM always left them
+    memset(store.levels, 0, sizeof(store.levels));
+    store.modes = 0;
+    memset(store.soft_start, 0xFF, sizeof(store.soft_start));
+    committed = store;                  // Nothing to write until one of them changes
+}
+
+
+/*
+ * Marks store for writing, once it has been left alone for STORE_COMMIT_HALF_CYCLES. Changes that come together
+ * (a run of group packets, say) share one record.
+ */
+void store_changed(void)
+{
+    dirty = true;
+    commit_delay = STORE_COMMIT_HALF_CYCLES;
+}
+
+
+/*
+ * Run from the main loop with a count that steps each zero cross. Returns true while a byte of a record is waiting
+ * for store_write(), bytes the slot already holds are passed over here without one.
+ */
+bool store_pending(uint8_t half_cycle)
+{
+    if(image_left == 0)
+    {
+        if(!dirty){
+            return false;
+        }
+        if(half_cycle != last_half_cycle)
+        {
+            last_half_cycle = half_cycle;
+            if(commit_delay){
+                commit_delay--;
+            }
+        }
+        if(commit_delay || !record_start()){
+            return false;
+        }
+    }
+    while(image_left && (eeprom_read_byte(next_address()) == image[next_offset()])){
+        record_advance();
+    }
+    return (image_left != 0);
+}
+
+
+/*
+ * Writes the byte store_pending() is waiting on. It takes the clock down to 8MHz for ~3.4ms, so the caller picks
+ * when: the timers run 20% slow meanwhile.
+ */
+void store_write(void)
+{
+    if(image_left){
+        record_write_next();
+    }
+}
+
+
+/*
+ * Writes any change now, a byte at a time (the watchdog is fed in between). For when the mains has gone and there are
+ * no gates to hold off. A record part way out is finished first, so it can be two records: up to 2 x RECORD_SIZE
+ * bytes at 3.4ms each.
+ */
+void store_flush(void)
+{
+    if((image_left == 0) && !(dirty && record_start())){
+        return;
+    }
+    while(image_left)
+    {
+        feedWatchdog();
+        record_write_next();
+    }
+}
@@ -0,0 +1,32 @@
+/*
+ * eeprom_store.h
+ *
+ * Settings kept across resets, in a wear levelled ring of EEPROM records (see eeprom_store.c)
+ */
+
+
+#ifndef EEPROM_STORE_H_
+#define EEPROM_STORE_H_
+
+#include <stdint.h>
+
+#define STORE_LIGHTS            3
+#define STORE_COMMIT_HALF_CYCLES    50  // A change is written once nothing else has changed for this many half cycles
+
+typedef struct{
+    uint8_t osccal;                 // Mains calibrated OSCCAL, 0 for none yet
+    uint8_t groups[STORE_LIGHTS];   // Group mask of each light
+    uint8_t levels[STORE_LIGHTS];   // Dim value of each light when the mains went
+    uint8_t modes;                  // Bit per light in burst fire mode
+    uint8_t soft_start[STORE_LIGHTS];   // Soft start step of each light, over 100 for the default
+}store_data_t;
+
+extern store_data_t store;          // Change it, then call store_changed()
+
+void store_init(void);
+void store_changed(void);
+bool store_pending(uint8_t half_cycle);
+void store_write(void);
+void store_flush(void);
+
+#endif /* EEPROM_STORE_H_ */
@@ -0,0 +1,42 @@
+/*
+ * firing_curves.h
+ *
+ * Gate delay per dim value (0 - 100), in thousandths of a half cycle.
+ * Each list is expanded with a macro X(permille), so the firing tables can be built by the compiler.
+ */ 
+
+
+#ifndef FIRING_CURVES_H_
+#define FIRING_CURVES_H_
+
+// Delay falls linearly with the dim value (the original behaviour)
+#define FIRING_CURVE_LINEAR(X) \
+    X(1000) X( 990) X( 980) X( 970) X( 960) X( 950) X( 940) X( 930) X( 920) X( 910) \
+    X( 900) X( 890) X( 880) X( 870) X( 860) X( 850) X( 840) X( 830) X( 820) X( 810) \
+    X( 800) X( 790) X( 780) X( 770) X( 760) X( 750) X( 740) X( 730) X( 720) X( 710) \
+    X( 700) X( 690) X( 680) X( 670) X( 660) X( 650) X( 640) X( 630) X( 620) X( 610) \
+    X( 600) X( 590) X( 580) X( 570) X( 560) X( 550) X( 540) X( 530) X( 520) X( 510) \
+    X( 500) X( 490) X( 480) X( 470) X( 460) X( 450) X( 440) X( 430) X( 420) X( 410) \
+    X( 400) X( 390) X( 380) X( 370) X( 360) X( 350) X( 340) X( 330) X( 320) X( 310) \
+    X( 300) X( 290) X( 280) X( 270) X( 260) X( 250) X( 240) X( 230) X( 220) X( 210) \
+    X( 200) X( 190) X( 180) X( 170) X( 160) X( 150) X( 140) X( 130) X( 120) X( 110) \
+    X( 100) X(  90) X(  80) X(  70) X(  60) X(  50) X(  40) X(  30) X(  20) X(  10) \
+    X(   0) \
+    /* end */
+
+// Delivered power (resistive load) rises linearly with the dim value: solves 1 - a + sin(2 pi a) / (2 pi) = dim / 100
+#define FIRING_CURVE_POWER(X) \
+    X(1000) X( 884) X( 853) X( 831) X( 813) X( 798) X( 785) X( 772) X( 761) X( 751) \
+    X( 741) X( 732) X( 723) X( 715) X( 707) X( 699) X( 691) X( 684) X( 677) X( 670) \
+    X( 664) X( 657) X( 651) X( 645) X( 638) X( 632) X( 626) X( 621) X( 615) X( 609) \
+    X( 604) X( 598) X( 593) X( 587) X( 582) X( 576) X( 571) X( 566) X( 561) X( 556) \
+    X( 550) X( 545) X( 540) X( 535) X( 530) X( 525) X( 520) X( 515) X( 510) X( 505) \
+    X( 500) X( 495) X( 490) X( 485) X( 480) X( 475) X( 470) X( 465) X( 460) X( 455) \
+    X( 450) X( 444) X( 439) X( 434) X( 429) X( 424) X( 418) X( 413) X( 407) X( 402) \
+    X( 396) X( 391) X( 385) X( 379) X( 374) X( 368) X( 362) X( 355) X( 349) X( 343) \
+    X( 336) X( 330) X( 323) X( 316) X( 309) X( 301) X( 293) X( 285) X( 277) X( 268) \
+    X( 259) X( 249) X( 239) X( 228) X( 215) X( 202) X( 187) X( 169) X( 147) X( 116) \
+    X(   0) \
+    /* end */
+
+#endif /* FIRING_CURVES_H_ */
@@ -6,12 +6,22 @@
  */ 
 
 #include "cams_attiny85_lib.h"
+#include "firing_curves.h"
+#include "eeprom_store.h"
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <string.h>
 
 #define LIGHTS              1   // Set how many output lights are needed (1 - 3)
 
 #define AC_DIM_MIN_PERCENT  20  // The min percent before the light stays off
 #define AC_DIM_MAX_PERCENT  95  // The max percent before the light stays on
 
+#define MAINS_HZ            50  // Mains frequency, the zero cross period is the reference OSCCAL gets trimmed against
+
+// How the dim value maps to the firing angle, one of the lists in firing_curves.h
+#define FIRING_CURVE        FIRING_CURVE_LINEAR
+
 // The pin outs for the Light PWM and zero cross pin
 // DO NOT USE: PB0 and PB2. I2C uses these pins
 #define LIGHT_PIN_0         PB4
@@ -19,31 +29,163 @@
 #define LIGHT_PIN_2         PB5
 #define ZERO_CROSS_PIN      PB3 // PB1 for lounge light
 
+// Light 0 (PB4) and light 1 (PB1) sit on the Timer 1 compare outputs OC1B and OC1A, so their gates can be
+// raised by the timer hardware itself instead of from the compare ISR. The output still has to be switched to set on
+// match by the timer 1 overflow ISR that starts the compare's overflow period (by the zero cross for the first one),
+// so the gate is only on time if that ISR gets in before the match. If the USI or PCINT hold it up past the match,
+// it raises the gate late with a FOC strobe. Light 2 is always driven in software. Comment out for all in software.
+#define GATE_DRIVE_HARDWARE
+
+#ifdef GATE_DRIVE_HARDWARE
+#if (LIGHT_PIN_0 != OC1B_PIN) || (LIGHT_PIN_1 != OC1A_PIN)
+#error "GATE_DRIVE_HARDWARE needs light 0 on OC1B (PB4) and light 1 on OC1A (PB1)"
+#endif
+#define HARDWARE_GATES      (_BV(OC1A_PIN) | _BV(OC1B_PIN))     // PORTB has no say over these
+#else
+#define HARDWARE_GATES      0
+#endif
+
+// Gate drive: with GATE_PULSE_US at 0 the gate is held from the firing point to the zero cross. Otherwise it gets a
+// pulse this long (the TRIAC latches within a few us), followed by GATE_RETRIGGER_PULSES more every GATE_RETRIGGER_US
+// for inductive and LED loads that can drop below the holding current. Lights at AC_DIM_MAX_PERCENT are always held.
+// Held by default: a short pulse into a load that hasn't reached the holding current yet (LED drivers, transformers)
+// can leave the TRIAC off for the half cycle. Only pulse with a retrigger train, once it is checked on the load.
+#define GATE_PULSE_US           0
+#define GATE_RETRIGGER_PULSES   0
+#define GATE_RETRIGGER_US       1000
+#define GATE_PULSE_EDGES        (2 * (GATE_RETRIGGER_PULSES + 1))   // On and off edges in each train
+
+// Soft start: a light switched on from off climbs to its dim value by at most this much a half cycle, which spreads
+// the inrush of cold filaments and transformers. Set per light with CMD_SOFT_START, 0 for none.
+#define SOFT_START_STEP         5
+
+// Port B masks of the light pins, so all the gates can be written with one store
+#define LIGHT_MASK_0        _BV(LIGHT_PIN_0)
+#define LIGHT_MASK_1        _BV(LIGHT_PIN_1)
+#define LIGHT_MASK_2        _BV(LIGHT_PIN_2)
+#define ALL_LIGHTS          ((1 << LIGHTS) - 1)     // One bit per light
+
+// OSCCAL auto trim: the half cycle is measured in timer 0 ticks and averaged over OSC_CAL_SAMPLES zero crosses
+#define OSC_CAL_SAMPLES         16
+#define HALF_CYCLE_TICKS        (TIM0_TICK_HZ / (2 * MAINS_HZ))             // 3125 at 50Hz
+#define HALF_CYCLE_TICKS_MIN    (HALF_CYCLE_TICKS - HALF_CYCLE_TICKS / 8)   // Anything outside +-12.5% is a missed or
+#define HALF_CYCLE_TICKS_MAX    (HALF_CYCLE_TICKS + HALF_CYCLE_TICKS / 8)   // noisy zero cross (or the wrong MAINS_HZ)
+#define OSC_CAL_TARGET          ((uint16_t)(HALF_CYCLE_TICKS * OSC_CAL_SAMPLES))
+#define OSC_CAL_DEADBAND        (OSC_CAL_TARGET / 400)      // +-0.25%, about half an OSCCAL step
+#define OSC_CAL_TICKS_PER_STEP  (OSC_CAL_TARGET / 200)      // One OSCCAL step moves the clock roughly 0.5%
+#define OSC_CAL_MAX_STEP        2                           // Keep each clock change small
+#define MAINS_LOST_TICKS        (2 * HALF_CYCLE_TICKS)      // No zero cross for a whole mains cycle
+
+// An EEPROM byte (~3.4ms at the factory clock) is only started this early in a held half cycle, so it is done well
+// before the next zero cross (8.3ms at 60Hz)
+#define STORE_WINDOW_TICKS      (HALF_CYCLE_TICKS / 4)
+
 // The I2C packet structure : [0x6A (Address), light_number (0 - 2), dim_value (0 - 100)]
-#define I2C_PACKET_SIZE     2    // excluding the address
+// Packets written to the general call address (0x00) are taken by every dimmer on the bus.
+// Instead of a light number, the first byte can be one of these commands:
+#define CMD_LIGHT_MODE      0x10    // [0x10 + light_number, mode] picks how the light is dimmed (LIGHT_MODE_x), kept in EEPROM
+#define CMD_LIGHT_GROUPS    0x20    // [0x20 + light_number, group_mask] the groups (bit 0 - 7) the light is in, kept in EEPROM
+#define CMD_SOFT_START      0x30    // [0x30 + light_number, step] soft start step of the light (0 for none), kept in EEPROM
+#define CMD_GROUP_LEVEL     0x50    // [0x50 + group (0 - 7), dim_value] sets every light in the group
+#define CMD_ALL_LEVEL       0x5F    // [0x5F, dim_value] sets every light
+#define CMD_SELECT_REPORT   0x80    // [0x80, report] picks what an I2C read from 0x6A returns
+#define CMD_SYNC            0x83    // [0x83, x] restarts the half cycle count (send to the general call, every node takes it on the same byte)
+#define CMD_DEFER           0x84    // [0x84, N] the next level packet (light, group or all) is held until half cycle N
+                                    // after the sync, so dimmers that got it at different times all change together
+
+#define DEFER_SLOTS         4       // Deferred level packets that can be waiting at once
+
+// Light modes
+#define LIGHT_MODE_PHASE    0x00    // Phase angle, fired part way through every half cycle
+#define LIGHT_MODE_BURST    0x01    // Burst fire, whole mains cycles on or off (heaters), the dim value is the % of cycles on
+
+// Reports, all multi byte values are LSB first
+#define REPORT_RESETS       0x00    // reset_report_t
+
+typedef struct{
+    uint16_t boots;
+    uint16_t power_on;      // PORF
+    uint16_t external;      // EXTRF
+    uint16_t brown_out;     // BORF
+    uint16_t watchdog;      // WDRF, a stalled main loop
+}reset_counts_t;
+
+typedef struct{
+    uint8_t reset_cause;    // MCUSR at the last boot
+    reset_counts_t counts;
+    uint8_t i2c_dropped;    // Packets lost since boot
+}reset_report_t;
+
+typedef struct{
+    uint8_t half_cycle;     // Half cycle (since the sync) it is applied in
+    uint8_t light_mask;     // Bit per light
+    uint8_t dim;
+}deferred_t;
 
 typedef struct{
-    uint8_t zero_cross;     // Set when a zero cross happens
     uint8_t dim_trans_buf;  // The current dim value
     uint8_t dim_buf;        // The next dim value
 }light_store_t;
 
 
 volatile light_store_t light_store[LIGHTS] = {0};
+volatile uint8_t zero_cross = 0;            // Bit per light, set when a zero cross happens
+volatile uint8_t gate_reset_mask = 0;       // Port B mask of the gates to turn off at a zero cross
+volatile uint8_t gate_fire_mask = 0;        // Port B mask of the gates that fire this half cycle
+volatile uint8_t burst_mask = 0;            // Bit per light in burst fire mode
+volatile uint8_t soft_start_step[LIGHTS];   // Max dim value rise a half cycle for a light coming on from off
+uint8_t soft_start_mask = 0;                // Bit per light, set while it ramps up from off
+uint8_t burst_error[LIGHTS] = {0};          // Error diffusion of the on cycles
+volatile uint8_t half_cycle_count = 0;      // Zero crosses since the last sync
+volatile deferred_t deferred[DEFER_SLOTS];
+volatile uint8_t deferred_used = 0;         // Bit per deferred slot
+uint8_t defer_half_cycle = 0;               // Tag for the next level packet
+bool defer_next = false;
+
+volatile bool gate_hold = false;            // Set by the main loop to have the gates held off from the next zero cross
+volatile bool gates_held = false;           // The phase gates aren't fired this half cycle, for an EEPROM write
+
+volatile uint16_t osc_cal_ticks = 0;        // Sum of the measured half cycles
+volatile uint8_t osc_cal_samples = 0;
+
+reset_counts_t reset_counts = {0};
+volatile reset_report_t reset_report;
+
+static const uint8_t light_pin_mask[3] = {LIGHT_MASK_0, LIGHT_MASK_1, LIGHT_MASK_2};
+
+#if GATE_PULSE_US
+volatile uint8_t gate_pulse_step[LIGHTS] = {0};     // Edges of the pulse train done this half cycle (0 for none)
+volatile uint8_t gate_pulse_active = 0;             // Bit per light, set while its pulse train runs
+#endif
 
 
 /*
- * Calculates the timer output compare value from the Dim percentage passed in
+ * Firing tables: the timer compare value for each dim value (0 - 100), one per timer tick rate.
+ * Built by the compiler from the tick rate, MAINS_HZ and FIRING_CURVE, so the ISRs only do a flash lookup.
+ */
+#define FIRE_TICKS(tick_hz, permille)   ((uint16_t)(((uint32_t)(permille) * (tick_hz)) / (2UL * MAINS_HZ * 1000UL)))
+#define TIM0_FIRE_TICKS(permille)       FIRE_TICKS(TIM0_TICK_HZ, permille),
+#define TIM1_FIRE_TICKS(permille)       FIRE_TICKS(TIM1_TICK_HZ, permille),
+
+static const uint16_t fire_table_tim0[101] PROGMEM = { FIRING_CURVE(TIM0_FIRE_TICKS) };
+static const uint16_t fire_table_tim1[101] PROGMEM = { FIRING_CURVE(TIM1_FIRE_TICKS) };
+
+#define US_TO_TICKS(tick_hz, us)        ((uint16_t)(((uint32_t)(us) * (tick_hz)) / 1000000UL))
+
+
+/*
+ * Looks up the timer output compare value for the Dim percentage passed in
+ * @param timer: The timer the compare is for, each one has its own tick rate
  * @param dim: Dim value between 0 (off) and 100 (max)
  */
-uint8_t Calc_Dim_CCR(uint32_t dim)
+static inline uint16_t Calc_Dim_CCR(TIMx_e timer, uint8_t dim)
 {
     dim = (dim < 100) ? dim : 100;  // Check limits
-    // 10ms is max brightness
-    // uint32_t t_cnt_ns = (AC_DIM_PRESCALER + 1) * 1000000000 / SystemCoreClock; // In ns
-    // return dim * 100000 / t_cnt_ns;
 
-    return (uint8_t)(((100 - dim) * F_CPU) / (PRESCALER * 10000UL));
+    if(timer < TIM1_A){
+        return pgm_read_word(&fire_table_tim0[dim]);
+    }
+    return pgm_read_word(&fire_table_tim1[dim]);
 }
 
 
@@ -62,59 +204,414 @@ uint8_t map_pin(uint8_t pin)
 }
 
 
+/*
+ * Utility function that maps a light to the timer compare that fires it
+ */
+TIMx_e map_timer(uint8_t num)
+{
+#ifdef GATE_DRIVE_HARDWARE
+    switch(num)
+    {
+        case 0: return TIM1_B;  // OC1B
+        case 1: return TIM1_A;  // OC1A
+        case 2: return TIM0_A;
+        default: return TIM1_B;
+    }
+#else
+    switch(num)
+    {
+        case 0: return TIM0_A;
+        case 1: return TIM0_B;
+        case 2: return TIM1_A;
+        default: return TIM0_A;
+    }
+#endif
+}
+
+
+/*
+ * Keeps the zero cross masks up to date with a light's dim value, so the zero cross doesn't have to look at every light
+ */
+void update_gate_masks(uint8_t num)
+{
+    uint8_t pin_mask = light_pin_mask[num];
+    
+    if(light_store[num].dim_trans_buf < AC_DIM_MAX_PERCENT){
+        gate_reset_mask |= pin_mask;
+    }else{
+        gate_reset_mask &= ~pin_mask;
+    }
+    if(light_store[num].dim_trans_buf > AC_DIM_MIN_PERCENT){
+        gate_fire_mask |= pin_mask;
+    }else{
+        gate_fire_mask &= ~pin_mask;
+    }
+}
+
+
+/*
+ * Next step towards a new dim value, only a light coming on from off is held back (to soft_start_step a half cycle)
+ */
+static inline uint8_t soft_start(uint8_t num, uint8_t dim)
+{
+    uint8_t light_bit = _BV(num);
+    uint8_t now = light_store[num].dim_trans_buf;
+    uint16_t limit;
+    
+    if(dim <= now)
+    {
+        soft_start_mask &= ~light_bit;
+        return dim;
+    }
+    if(now <= AC_DIM_MIN_PERCENT)
+    {
+        if(!soft_start_step[num]){
+            return dim;
+        }
+        soft_start_mask |= light_bit;
+        now = AC_DIM_MIN_PERCENT;
+    }
+    else if(!(soft_start_mask & light_bit))
+    {
+        return dim;     // Already on, not limited
+    }
+    
+    limit = now + soft_start_step[num];
+    if(dim <= limit)
+    {
+        soft_start_mask &= ~light_bit;  // Got there
+        return dim;
+    }
+    return (uint8_t)limit;
+}
+
+
+/*
+ * Loads the firing point for the next half cycle, picking up a new dim value if there is one
+ */
+void load_light(uint8_t num)
+{
+    TIMx_e timer = map_timer(num);
+    
+    if(light_store[num].dim_trans_buf != light_store[num].dim_buf)
+    {
+        light_store[num].dim_trans_buf = soft_start(num, light_store[num].dim_buf);
+        update_gate_masks(num);
+    }
+#if !GATE_PULSE_US
+    else
+    {
+        return;     // The compare is still on the firing point
+    }
+#endif
+    SetTimerCompare(timer, Calc_Dim_CCR(timer, light_store[num].dim_trans_buf));
+}
+
+
+#if GATE_PULSE_US
+/*
+ * Timer ticks from the firing point to the next edge of the gate pulse train
+ * @param step: Edges already done, odd steps are the ends of pulses
+ */
+static inline uint16_t gate_pulse_offset(TIMx_e timer, uint8_t step)
+{
+    uint32_t tick_hz = (timer < TIM1_A) ? TIM0_TICK_HZ : TIM1_TICK_HZ;
+    uint16_t offset = (step / 2) * US_TO_TICKS(tick_hz, GATE_RETRIGGER_US);
+    
+    if(step & 1){
+        offset += US_TO_TICKS(tick_hz, GATE_PULSE_US);
+    }
+    return offset;
+}
+
+/*
+ * Called at the firing point, the gate has just been raised and the compare moves on to the end of the pulse
+ */
+void start_gate_pulse(uint8_t num)
+{
+    TIMx_e timer = map_timer(num);
+    
+    gate_pulse_step[num] = 1;
+    gate_pulse_active |= _BV(num);
+    ScheduleTimerCompare(timer, Calc_Dim_CCR(timer, light_store[num].dim_trans_buf) + gate_pulse_offset(timer, 1));
+}
+
+/*
+ * Stops a light's pulse train and puts its compare back on the firing point
+ */
+void end_gate_pulse(uint8_t num)
+{
+    gate_pulse_step[num] = 0;
+    gate_pulse_active &= ~_BV(num);
+    load_light(num);
+}
+
+/*
+ * Next edge of a light's gate pulse train, the same compare is moved on to each edge in turn
+ */
+void gate_pulse(uint8_t num)
+{
+    uint8_t pin_mask = light_pin_mask[num];
+    uint8_t step = gate_pulse_step[num];
+    TIMx_e timer = map_timer(num);
+    
+    if(step & 1)
+    {
+        resetPins(pin_mask);
+        ResetTimerOutputs(pin_mask);
+    }
+    else
+    {
+        setPins(pin_mask);
+        SetTimerOutputs(pin_mask);
+    }
+    
+    if(++step < GATE_PULSE_EDGES)
+    {
+        gate_pulse_step[num] = step;
+        ScheduleTimerCompare(timer, Calc_Dim_CCR(timer, light_store[num].dim_trans_buf) + gate_pulse_offset(timer, step));
+    }
+    else
+    {
+        end_gate_pulse(num);
+    }
+}
+#endif
+
+
 /*
  * Interrupt function for when an output compare on the timers happens, this sets the PWM duty cycle
  */
 void isr_light(uint8_t num)
 {
-    if(light_store[num].zero_cross)
+    uint8_t light_bit = _BV(num);
+    
+#if GATE_PULSE_US
+    if(gate_pulse_active & light_bit)
     {
-        light_store[num].zero_cross = 0;
+        gate_pulse(num);
+        return;
+    }
+#endif
+
+    if(zero_cross & light_bit)
+    {
+        zero_cross &= ~light_bit;
 
-        if(light_store[num].dim_trans_buf > AC_DIM_MIN_PERCENT)
+        if((light_store[num].dim_trans_buf > AC_DIM_MIN_PERCENT) && !gates_held)
         {
-            setPin(map_pin(num));
+            setPins(light_pin_mask[num] & ~HARDWARE_GATES);     // The timer raised it if it is on a compare output
+#if GATE_PULSE_US
+            if(light_store[num].dim_trans_buf < AC_DIM_MAX_PERCENT)
+            {
+                start_gate_pulse(num);  // The next dim value is picked up when the train ends
+                return;
+            }
+#endif
         }
     }
     
-    if(light_store[num].dim_trans_buf != light_store[num].dim_buf)
+    load_light(num);
+}
+
+/*
+ * Adds the time since the last zero cross to the OSCCAL calibration sum
+ * @param ticks: Timer 0 ticks since the last zero cross
+ */
+void measureHalfCycle(uint16_t ticks)
+{
+    if((ticks > HALF_CYCLE_TICKS_MIN) && (ticks < HALF_CYCLE_TICKS_MAX) && (osc_cal_samples < OSC_CAL_SAMPLES))
     {
-        light_store[num].dim_trans_buf = light_store[num].dim_buf;
-        SetTimerCompare((TIMx_e)num, Calc_Dim_CCR(light_store[num].dim_trans_buf));
+        osc_cal_ticks += ticks;
+        osc_cal_samples++;
     }
 }
 
+
+/*
+ * Burst fire, run at each zero cross. At the start of every full mains cycle the error diffusion decides which
+ * burst lights conduct for the whole cycle, so the on cycles are spread evenly and the load sees no DC.
+ * The gates are held through the cycle, a TRIAC fired at the zero cross switches at (near) zero volts.
+ */
+void burst_zero_cross(void)
+{
+    static uint8_t half_cycle = 0;
+    uint8_t on_mask = 0;
+    uint8_t off_mask = 0;
+    uint8_t i;
+    
+    half_cycle ^= 1;
+    if(!half_cycle){
+        return;
+    }
+    
+    for(i = 0; i < LIGHTS; i++)
+    {
+        uint8_t level = light_store[i].dim_buf;
+        bool on;
+        
+        if(!(burst_mask & _BV(i))){
+            continue;
+        }
+        
+        if(level <= AC_DIM_MIN_PERCENT)
+        {
+            on = false;
+        }
+        else if(level >= AC_DIM_MAX_PERCENT)
+        {
+            on = true;
+        }
+        else
+        {
+            burst_error[i] += level;
+            on = (burst_error[i] >= 100);
+            if(on){
+                burst_error[i] -= 100;
+            }
+        }
+        
+        if(on){
+            on_mask |= light_pin_mask[i];
+        }else{
+            off_mask |= light_pin_mask[i];
+        }
+    }
+    
+    resetPins(off_mask);
+    ResetTimerOutputs(off_mask);
+    setPins(on_mask);
+    SetTimerOutputs(on_mask);
+}
+
+
+/*
+ * Applies the deferred level packets due this half cycle, run at the zero cross
+ */
+void apply_deferred(void)
+{
+    uint8_t slot, i;
+    
+    for(slot = 0; slot < DEFER_SLOTS; slot++)
+    {
+        if((deferred_used & _BV(slot)) && (deferred[slot].half_cycle == half_cycle_count))
+        {
+            for(i = 0; i < LIGHTS; i++)
+            {
+                if(deferred[slot].light_mask & _BV(i)){
+                    light_store[i].dim_buf = deferred[slot].dim;
+                }
+            }
+            deferred_used &= ~_BV(slot);
+        }
+    }
+}
+
+
 /*
  * Interrupt function for when a zero cross gets triggered
  */
 void isr_zeroCross(uint8_t num)
 {
-    int i;
+    uint16_t half_cycle_ticks;
     
     // Make sure if all zero cross's has been cleared (prevents multiple interrupts for same zero cross)
-    for (i = 0; i < LIGHTS; i++){
-        if(light_store[i].zero_cross){
-            return;
-        }
+    if(zero_cross){
+        return;
     }
     
-    for (i = 0; i < LIGHTS; i++)
-    {
-        // Zero Cross just happened
-        light_store[i].zero_cross = 1;
+    // Zero Cross just happened
+    half_cycle_ticks = GetTimerCount(TIM0_A);
+    zero_cross = ALL_LIGHTS & ~burst_mask;      // Burst lights have no compare to clear theirs
+    if(!gates_held){
+        measureHalfCycle(half_cycle_ticks);     // Timer 0 ran slow for the EEPROM write in a held one
+    }
+    
+    half_cycle_count++;
+    if(deferred_used){
+        apply_deferred();
+    }
+    
+    // Only lights in phase mode hold off a bounce, so check the burst lights see a whole half cycle
+    if(burst_mask && (half_cycle_ticks > HALF_CYCLE_TICKS_MIN)){
+        burst_zero_cross();
+    }
 
-        // Turn TRIACs off if it shouldn't stay on
-        if(light_store[i].dim_trans_buf < AC_DIM_MAX_PERCENT)
+    // Turn TRIACs off if they shouldn't stay on
+    resetPins(gate_reset_mask);
+    ResetTimerOutputs(gate_reset_mask);
+    
+#if GATE_PULSE_US
+    // Trains that ran into the zero cross (lights near full) need their compare back on the firing point
+    if(gate_pulse_active)
+    {
+        uint8_t i;
+        
+        for(i = 0; i < LIGHTS; i++)
         {
-            resetPin(map_pin(i));
+            if(gate_pulse_active & _BV(i)){
+                end_gate_pulse(i);
+            }
         }
     }
+#endif
+    
+    // Gates on a compare output only need re-arming, the timer raises them
+    gates_held = gate_hold;
+    ArmTimerOutputs(gates_held ? 0 : gate_fire_mask);
     
     // Start the counter from 0 again
     ResetAllCounters();
 }
 
 
+/*
+ * Closed loop OSCCAL trim against the mains frequency, run from the main loop.
+ * The first time it settles after boot the value is stored, so the next boot starts calibrated. Like every setting it
+ * is written by store_service(), at the factory clock, and the half cycles that write is in aren't measured.
+ */
+void osc_calibration(void)
+{
+    static bool stored = false;
+    int16_t error;
+    int16_t step;
+    int16_t cal;
+    
+    if(osc_cal_samples < OSC_CAL_SAMPLES){
+        return;
+    }
+    
+    cli();
+    error = (int16_t)(osc_cal_ticks - OSC_CAL_TARGET);   // Positive means the clock is running fast
+    osc_cal_ticks = 0;
+    osc_cal_samples = 0;
+    sei();
+    
+    if((error > -OSC_CAL_DEADBAND) && (error < OSC_CAL_DEADBAND))
+    {
+        if(!stored)
+        {
+            store.osccal = OSCCAL;
+            store_changed();
+            stored = true;
+        }
+        return;
+    }
+    
+    step = error / OSC_CAL_TICKS_PER_STEP;
+    if(step == 0){
+        step = (error > 0) ? 1 : -1;
+    }
+    step = (step > OSC_CAL_MAX_STEP) ? OSC_CAL_MAX_STEP : step;
+    step = (step < -OSC_CAL_MAX_STEP) ? -OSC_CAL_MAX_STEP : step;
+    
+    cal = (int16_t)OSCCAL - step;
+    cal = (cal > OSCCAL_MAX) ? OSCCAL_MAX : cal;
+    cal = (cal < OSCCAL_MIN) ? OSCCAL_MIN : cal;
+    OSCCAL = (uint8_t)cal;
+}
+
+
 /*
  * Initialize the timers for output compare
  */
@@ -122,8 +619,14 @@ void timer_init(void)
 {
     int i;
     
+    // Timer 0 is also the time base the zero cross period is measured with, so it always runs
+    InitialiseTimer(TIM0_A, NULL, 0);
+    
     for(i = 0; i < LIGHTS; i++){
-        InitialiseTimer((TIMx_e)i, isr_light);
+        InitialiseTimer(map_timer(i), (burst_mask & _BV(i)) ? NULL : isr_light, i);    // Burst lights have no compare
+#ifdef GATE_DRIVE_HARDWARE
+        EnableTimerOutput(map_timer(i));    // Does nothing for the timer 0 compares
+#endif
     }
 }
 
@@ -138,11 +641,99 @@ void gpio_init(void)
     for(i = 0; i < LIGHTS; i++){
         setPinOutput(map_pin(i));
         resetPin(map_pin(i));
+        gate_reset_mask |= light_pin_mask[i];
         light_store[i].dim_buf = AC_DIM_MIN_PERCENT - 1;
+        soft_start_step[i] = (store.soft_start[i] <= 100) ? store.soft_start[i] : SOFT_START_STEP;
     }
 }
 
 
+/*
+ * Puts the lights back at the levels and in the modes they were in when the mains went, so they are on from the first
+ * zero crosses. Before timer_init(), which leaves the burst lights without a compare.
+ */
+void level_restore(void)
+{
+    uint8_t i;
+    
+    for(i = 0; i < LIGHTS; i++)
+    {
+        if((store.levels[i] >= AC_DIM_MIN_PERCENT) && (store.levels[i] <= AC_DIM_MAX_PERCENT + 1)){
+            light_store[i].dim_buf = store.levels[i];     // Anything else (blank EEPROM) stays off
+        }
+        if(store.modes & _BV(i))
+        {
+            burst_mask |= _BV(i);
+            gate_reset_mask &= ~light_pin_mask[i];      // The burst fire drives the gate itself
+        }
+    }
+}
+
+
+/*
+ * Run from the main loop. Writes the changed settings a byte at a time, each in a half cycle of its own with the phase
+ * gates held off: the clock is down at 8MHz for the write (see eepromClockDown()) and the timers would fire them
+ * late. Those lights miss that half cycle, lights held full on and burst lights (switched at the zero cross) don't.
+ */
+void store_service(void)
+{
+    uint16_t ticks;
+    
+    if(!store_pending(half_cycle_count))
+    {
+        gate_hold = false;
+        return;
+    }
+    gate_hold = true;
+    if(!gates_held){
+        return;             // Held from the next zero cross
+    }
+    
+    cli();
+    ticks = GetTimerCount(TIM0_A);
+    sei();
+    if(ticks < STORE_WINDOW_TICKS){
+        store_write();      // Another byte keeps gate_hold set for the half cycle after
+    }
+}
+
+
+/*
+ * Run from the main loop. Timer 0 is only reset by the zero cross and its count saturates, so once it passes a whole
+ * mains cycle the mains has gone: the levels are stored while the supply holds up (~3.4ms for each changed byte of
+ * the record). Any other change waiting on the commit delay goes with them, and with no zero crosses to time that
+ * delay any change after is stored straight away too.
+ * Hold-up time: store_flush() can have a record in the background to finish before this one, 26 bytes (~90ms) at
+ * worst. The supply has to keep VCC above the brown-out level for that long after the last zero cross plus the
+ * detection (a mains cycle), ~110ms at 50Hz, or the newest levels can be lost (the record before them stays good).
+ */
+void power_fail_check(void)
+{
+    static bool lost = false;
+    uint16_t ticks;
+    uint8_t i;
+    
+    cli();
+    ticks = GetTimerCount(TIM0_A);
+    sei();
+    
+    if(ticks < MAINS_LOST_TICKS)
+    {
+        lost = false;
+        return;
+    }
+    if(!lost)
+    {
+        lost = true;
+        for(i = 0; i < LIGHTS; i++){
+            store.levels[i] = light_store[i].dim_buf;
+        }
+        store_changed();
+    }
+    store_flush();
+}
+
+
 /*
  * Initialize the zero cross interrupt
  */
@@ -152,34 +743,266 @@ void exti_init(void)
 }
 
 
+/*
+ * Counts this boot and its cause in EEPROM, so bus stalls (watchdog) can be told apart from brown-outs.
+ * Call before overclock(), the EEPROM can't be written with the oscillator above 8.8MHz.
+ */
+void reset_log_init(void)
+{
+    uint8_t cause = getResetCause();
+    
+    eeprom_read_block(&reset_counts, EEPROM_ADDR_RESETS, sizeof(reset_counts));
+    if(reset_counts.boots == 0xFFFF){
+        memset(&reset_counts, 0, sizeof(reset_counts));     // Blank EEPROM
+    }
+    
+    reset_counts.boots++;
+    if(cause & _BV(PORF))   { reset_counts.power_on++; }
+    if(cause & _BV(EXTRF))  { reset_counts.external++; }
+    if(cause & _BV(BORF))   { reset_counts.brown_out++; }
+    if(cause & _BV(WDRF))   { reset_counts.watchdog++; }
+    
+    eeprom_update_block(&reset_counts, EEPROM_ADDR_RESETS, sizeof(reset_counts));
+}
+
+
+/*
+ * Fills in the requested report and hands it to the I2C, ready for the next master read
+ */
+void select_report(uint8_t report)
+{
+    switch(report)
+    {
+        case REPORT_RESETS:
+        default:
+            reset_report.reset_cause = getResetCause();
+            reset_report.counts = reset_counts;
+            reset_report.i2c_dropped = i2c_get_dropped_packets();
+            i2c_set_transmit_data((const volatile uint8_t *)&reset_report, sizeof(reset_report));
+            break;
+    }
+}
+
+
+/*
+ * Switches a light between phase angle and burst fire. A burst light gives up its timer compare.
+ */
+void set_light_mode(uint8_t num, uint8_t mode)
+{
+    uint8_t pin_mask = light_pin_mask[num];
+    TIMx_e timer = map_timer(num);
+    
+    cli();
+    if(mode == LIGHT_MODE_BURST)
+    {
+        if(!(burst_mask & _BV(num)))
+        {
+            AttachTimerInterrupt(timer, NULL, num);
+            burst_mask |= _BV(num);
+            burst_error[num] = 0;
+            zero_cross &= ~_BV(num);
+            gate_reset_mask &= ~pin_mask;   // The burst fire drives the gate itself
+            gate_fire_mask &= ~pin_mask;
+#if GATE_PULSE_US
+            gate_pulse_step[num] = 0;
+            gate_pulse_active &= ~_BV(num);
+#endif
+            resetPins(pin_mask);
+            ResetTimerOutputs(pin_mask);
+        }
+    }
+    else if(burst_mask & _BV(num))
+    {
+        burst_mask &= ~_BV(num);
+        resetPins(pin_mask);
+        ResetTimerOutputs(pin_mask);
+        light_store[num].dim_trans_buf = 0;             // Comes on from off, through the soft start
+        light_store[num].dim_trans_buf = soft_start(num, light_store[num].dim_buf);
+        update_gate_masks(num);
+        SetTimerCompare(timer, Calc_Dim_CCR(timer, light_store[num].dim_trans_buf));
+        AttachTimerInterrupt(timer, isr_light, num);    // Fires from the next zero cross
+    }
+    sei();
+}
+
+
+/*
+ * Queues a level packet for the zero cross of half cycle defer_half_cycle, returns false if there is no free slot
+ */
+bool defer_lights(uint8_t light_mask, uint8_t dim)
+{
+    uint8_t slot;
+    
+    for(slot = 0; slot < DEFER_SLOTS; slot++)
+    {
+        if(!(deferred_used & _BV(slot)))
+        {
+            deferred[slot].half_cycle = defer_half_cycle;
+            deferred[slot].light_mask = light_mask;
+            deferred[slot].dim = dim;
+            cli();
+            deferred_used |= _BV(slot);
+            sei();
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/*
+ * Sets the dim value of every light in the mask (bit per light)
+ */
+void set_lights(uint8_t light_mask, uint8_t dim)
+{
+    uint8_t light_val;
+    uint8_t i;
+    
+    light_val = (dim > AC_DIM_MAX_PERCENT) ? AC_DIM_MAX_PERCENT + 1 : dim;      // Check for max - we don't want to exceed these, otherwise the interrupts might happen out of order
+    light_val = (dim < AC_DIM_MIN_PERCENT) ? AC_DIM_MIN_PERCENT - 1 : light_val; // Check for min - we don't want to exceed these, otherwise the interrupts might happen out of order
+    
+    if(defer_next)
+    {
+        defer_next = false;
+        if(defer_lights(light_mask, light_val)){
+            return;
+        }
+        // No free slot, apply it now rather than lose it
+    }
+    
+    for(i = 0; i < LIGHTS; i++)
+    {
+        if(light_mask & _BV(i)){
+            light_store[i].dim_buf = light_val;     // The light_store is serviced in the interrupts
+        }
+    }
+}
+
+
+/*
+ * Bit per light in the group
+ */
+uint8_t group_lights(uint8_t group)
+{
+    uint8_t light_mask = 0;
+    uint8_t i;
+    
+    for(i = 0; i < LIGHTS; i++)
+    {
+        if(store.groups[i] & _BV(group)){
+            light_mask |= _BV(i);
+        }
+    }
+    return light_mask;
+}
+
+
+/*
+ * Runs in the I2C interrupt as each packet completes. The sync is taken here, not behind the packet queue and the
+ * EEPROM work in the main loop, so every node on the general call restarts its count on the same zero cross.
+ */
+void i2c_packet_received(uint8_t cmd)
+{
+    if(cmd == CMD_SYNC){
+        half_cycle_count = 0;
+    }
+}
+
+
+/*
+ * Services one packet from the I2C master
+ */
+void handle_packet(uint8_t * buf)
+{
+    if(buf[0] < LIGHTS) // Make sure we don't overflow the light_store array
+    {
+        set_lights(_BV(buf[0]), buf[1]);
+    }
+    else if(buf[0] == CMD_ALL_LEVEL)
+    {
+        set_lights(ALL_LIGHTS, buf[1]);
+    }
+    else if((buf[0] & 0xF8) == CMD_GROUP_LEVEL)
+    {
+        set_lights(group_lights(buf[0] & 0x07), buf[1]);
+    }
+    else if((buf[0] & 0xF0) == CMD_LIGHT_GROUPS)
+    {
+        if((buf[0] & 0x0F) < LIGHTS)
+        {
+            store.groups[buf[0] & 0x0F] = buf[1];
+            store_changed();
+        }
+    }
+    else if((buf[0] & 0xF0) == CMD_SOFT_START)
+    {
+        if((buf[0] & 0x0F) < LIGHTS)
+        {
+            soft_start_step[buf[0] & 0x0F] = (buf[1] > 100) ? 100 : buf[1];
+            store.soft_start[buf[0] & 0x0F] = soft_start_step[buf[0] & 0x0F];
+            store_changed();
+        }
+    }
+    else if((buf[0] & 0xF0) == CMD_LIGHT_MODE)
+    {
+        if((buf[0] & 0x0F) < LIGHTS)
+        {
+            set_light_mode(buf[0] & 0x0F, buf[1]);
+            if(buf[1] == LIGHT_MODE_BURST){
+                store.modes |= _BV(buf[0] & 0x0F);
+            }else{
+                store.modes &= ~_BV(buf[0] & 0x0F);
+            }
+            store_changed();
+        }
+    }
+    else if(buf[0] == CMD_SYNC)
+    {
+        // Already applied by i2c_packet_received() as it came in
+    }
+    else if(buf[0] == CMD_DEFER)
+    {
+        defer_half_cycle = buf[1];
+        defer_next = true;
+    }
+    else if(buf[0] == CMD_SELECT_REPORT)
+    {
+        select_report(buf[1]);
+    }
+}
+
+
 int main(void)
 {
     uint8_t buf[I2C_PACKET_SIZE] = {0};
-    uint8_t len = 0;
-    uint8_t light_val = 0;
     
     watchdogSetup();                    // Initialize the watchdog
-    overclock();                        // Over-clock the system clock to 20Mhz
+    store_init();                       // Load the stored settings (calibration, light groups, levels and modes)
+    reset_log_init();                   // Count this boot and why it happened, still at the factory clock for the write
+    overclock(store.osccal);            // Over-clock the system clock to 20Mhz (with the stored calibration)
+    feedWatchdog();
     gpio_init();                        // Initialize the GPIO outputs that the PWM will output to
+    level_restore();                    // Back on as they were before a power cut
     timer_init();                       // Initialize the timers for output compare
     exti_init();                        // Initialize the zero cross interrupt
+    i2c_attach_packet_interrupt(i2c_packet_received);
     i2c_init();                         // Initialize the I2C comms
+    select_report(REPORT_RESETS);       // What an I2C read returns until the master picks something else
     enableGlobalInterrupts(true);       // Enable global interrupts
     
+    // Nothing in here waits on the bus, so a slow or stuck I2C master can't starve the watchdog.
+    // Stored settings go out a byte a pass at most, each waits ~3.4ms on the EEPROM. Only the store when the mains
+    // goes writes more than one (and feeds the watchdog between bytes).
     while(1)
     {
-        // If I2C data is being transmitted, we stay in this function until the whole packet is received
-        len = i2c_receive_data(&buf[0], I2C_PACKET_SIZE);
-        
-        if(len == I2C_PACKET_SIZE)
+        // Packets are queued by the I2C interrupts, take at most one per pass
+        if(i2c_receive_data(&buf[0], I2C_PACKET_SIZE) == I2C_PACKET_SIZE)
         {
-            if(buf[0] < LIGHTS) // Make sure we don't overflow the light_store array
-            {
-                light_val = (buf[1] > AC_DIM_MAX_PERCENT) ? AC_DIM_MAX_PERCENT + 1 : buf[1];    // Check for max - we don't want to exceed these, otherwise the interrupts might happen out of order
-                light_val = (buf[1] < AC_DIM_MIN_PERCENT) ? AC_DIM_MIN_PERCENT - 1 : light_val; // Check for min - we don't want to exceed these, otherwise the interrupts might happen out of order
-                light_store[buf[0]].dim_buf = light_val;                                        // The light_store is serviced in the interrupts
-            }
+            handle_packet(&buf[0]);
         }
+        osc_calibration();                  // Trim the clock against the mains
+        store_service();                    // Write changed settings to the EEPROM
+        power_fail_check();                 // Store the levels if the mains has gone
         feedWatchdog();
     }
 }
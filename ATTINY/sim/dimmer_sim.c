@@ -0,0 +1,759 @@
+/*
+ * dimmer_sim.c
+ *
+ * Cycle accurate bench for the ATtiny85 dimmer firmware, running the real .elf on the simavr emulator.
+ * Each scenario injects zero cross pulses on ZERO_CROSS_PIN and I2C master writes on PB0 (SDA) / PB2 (SCL),
+ * records every gate pin transition and reports per scenario:
+ *   - the worst case cycles spent in each interrupt vector (entry to reti)
+ *   - the firing angle error of each gate against the level last written over I2C
+ *   - I2C packets that were not ACKed, or whose level never showed up on the gate
+ * The exit code is non-zero if any scenario goes over its limits, so it can gate a release.
+ *
+ * Build (Linux, simavr and libelf installed):
+ *   gcc -O2 -o dimmer_sim dimmer_sim.c -lsimavr -lelf
+ * with -DMAINS_HZ=60 for firmware built for 60Hz. Only the scenarios at the firmware's mains frequency are run, the
+ * firmware times its firing points and trims its clock against a fixed MAINS_HZ.
+ *
+ * Run:
+ *   ./dimmer_sim <firmware.elf> [scenario name]
+ *
+ * Notes:
+ *   - The pin out, min/max percent and firing curve below must match main.c (linear curve assumed).
+ *   - simavr has no model of the tinyx5 PLL or of the timer 1 compare outputs. PLOCK is forced so the firmware
+ *     boots, timer 1's prescaler table is shifted so it counts PCK (4 x the system clock) instead of the system
+ *     clock, and the bench drives OC1A (PB1) and OC1B (PB4) itself from the COM1x bits, the FOC1x strobes and
+ *     the compare matches. While a channel is connected PORTB has no say over its pin, as on the chip, so the
+ *     firmware runs with GATE_DRIVE_HARDWARE as it ships. Timer 1 at PCK/1 or PCK/2 can't be shifted and stays
+ *     on the system clock.
+ *   - OSCCAL has no effect on the simulated clock, it always runs at SIM_F_CPU.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_io.h>
+#include <simavr/sim_irq.h>
+#include <simavr/avr_ioport.h>
+#include <simavr/avr_timer.h>
+
+#define SIM_F_CPU           20000000UL
+
+// Must match main.c
+#define LIGHTS              1
+#define AC_DIM_MIN_PERCENT  20
+#define AC_DIM_MAX_PERCENT  95
+#define SOFT_START_STEP     5
+#define ZERO_CROSS_PIN      3   // PB3
+#define I2C_SDA_PIN         0   // PB0
+#define I2C_SCL_PIN         2   // PB2
+#define I2C_ADDRESS         0x6A
+#ifndef MAINS_HZ
+#define MAINS_HZ            50
+#endif
+static const int light_pin[3] = {4, 1, 5};          // PB4, PB1, PB5
+
+#define ZC_PULSE_US         200     // Width of the zero cross detector pulse
+#define PLLCSR_DATA_ADDR    0x47    // PLLCSR (I/O 0x27) in data space
+#define PLOCK               0x01
+#define RETI_OPCODE         0x9518
+#define VECTORS             15      // ATtiny85 vector table, one word per vector
+#define APPLY_HALF_CYCLES   6       // A level not seen on the gate within this many half cycles is lost
+
+// A level is picked up by the light's compare (load_light() in isr_light()) and fired from the zero cross after it.
+// Written before this half cycle's compare it shows in the next half cycle, after it in the one after that. This
+// close to the compare (the main loop still has to take the packet from the I2C queue) it could be either.
+#define COMPARE_MARGIN_US   100
+
+// Timer 1 registers in data space (I/O + 0x20)
+#define TCCR1_DATA_ADDR     0x50
+#define TCNT1_DATA_ADDR     0x4F
+#define OCR1A_DATA_ADDR     0x4E
+#define GTCCR_DATA_ADDR     0x4C
+#define OCR1B_DATA_ADDR     0x4B
+#define COM1_SHIFT          4       // COM1A in TCCR1 and COM1B in GTCCR, bits 5:4
+#define COM1_CONNECTED      0x02    // COM1x1, the pin is the compare output
+#define COM1_SET            0x01    // COM1x0 with COM1x1, set on match (clear otherwise)
+#define FOC1A               0x04    // GTCCR
+#define FOC1B               0x08
+#define PCK_SHIFT           2       // PCK = 4 x the system clock
+
+#define US_TO_CYCLES(us)    ((avr_cycle_count_t)(us) * (SIM_F_CPU / 1000000UL))
+#define CYCLES_TO_US(c)     ((double)(c) * 1000000.0 / SIM_F_CPU)
+
+typedef struct{
+    const char * name;
+    int mains_hz;
+    int half_cycles;            // Length of the run
+    int i2c_hz;                 // SCL frequency
+    int packets_per_s;          // 0 for no I2C traffic
+    int isr_cycles_limit;       // Fail above this many cycles in any one ISR
+    int fire_error_limit_us;    // Fail above this firing angle error
+}scenario_t;
+
+static const scenario_t scenarios[] = {
+    // name                 Hz  half cycles  SCL      packets/s  ISR limit  error limit
+    { "idle-50hz",          50,  200,        100000,  0,         400,       20 },
+    { "steady-50hz",        50,  400,        100000,  10,        400,       20 },
+    { "i2c-flood-50hz",     50,  400,        400000,  200,       400,       20 },
+    { "steady-60hz",        60,  400,        100000,  10,        400,       20 },
+};
+
+static const char * vector_name[VECTORS] = {
+    "RESET", "INT0", "PCINT0", "TIMER1_COMPA", "TIMER1_OVF", "TIMER0_OVF", "EE_RDY", "ANA_COMP",
+    "ADC", "TIMER1_COMPB", "TIMER0_COMPA", "TIMER0_COMPB", "WDT", "USI_START", "USI_OVF"
+};
+
+// Levels the I2C traffic walks through, all inside the min/max so every one is visible on the gate
+static const uint8_t level_sequence[] = {30, 50, 70, 90, 60, 40, 25, 80};
+
+// ============== I2C master ==============
+
+typedef enum{
+    I2C_IDLE,
+    I2C_START,
+    I2C_BIT_LOW,        // SCL low, set SDA
+    I2C_BIT_HIGH,       // SCL high, sample
+    I2C_STOP_LOW,
+    I2C_STOP_HIGH,
+}i2c_phase_e;
+
+typedef struct{
+    i2c_phase_e phase;
+    uint8_t bytes[3];
+    int byte_index;
+    int bit_index;          // 0 - 7 data, 8 is the ACK clock
+    int acked;
+    avr_cycle_count_t quarter;
+    avr_cycle_count_t next;
+}i2c_master_t;
+
+// ============== Bench state ==============
+
+typedef struct{
+    int pin;
+    int level;                  // Level the gate should be showing
+    int target;                 // Level the soft start is climbing to
+    int ramping;                // Set while the soft start runs
+    int pending_level;          // Written over I2C, not in effect yet
+    int pending_half_cycles;    // Half cycles since pending_level was written (-1 for none)
+    int settle_half_cycles;     // Half cycles until pending_level is in effect
+    int unsure;                 // Set while the firing can't be scored, the level landed on the compare
+    int awaiting_apply;         // Half cycles left to see pending level on the gate (0 for none)
+    avr_cycle_count_t rise;     // Last rising edge this half cycle (0 for none)
+    double error_max_us;
+    double error_sum_us;
+    int error_samples;
+}gate_t;
+
+// Timer 1 compare output, modelled by the bench
+typedef struct{
+    int pin;
+    uint8_t ocr;
+    uint8_t com;                // COM1x1:0
+    uint8_t out;                // Level of the compare output
+}oc1_t;
+
+typedef struct{
+    avr_t * avr;
+    const scenario_t * sc;
+    avr_irq_t * zc_irq;
+    avr_irq_t * sda_irq;
+    avr_irq_t * scl_irq;
+    avr_cycle_count_t half_cycle;
+    avr_cycle_count_t zc_time;          // Last zero cross edge
+    avr_cycle_count_t next_zc;
+    avr_cycle_count_t zc_fall;
+    avr_cycle_count_t next_packet;
+    int half_cycle_count;
+    int packets_sent;
+    int packets_nacked;
+    int packets_lost;
+    int sequence_index;
+    gate_t gate[LIGHTS];
+    oc1_t oc1[2];                       // OC1A, OC1B
+    avr_cycle_count_t tcnt1_base;       // Cycle timer 1 last counted from 0
+    avr_cycle_count_t tcnt1_ticks;      // Timer 1 ticks up to the last step (not wrapped)
+    int tcnt1_shift;                    // log2 of the system clock cycles a timer 1 tick
+    i2c_master_t i2c;
+    int isr_vector;                     // Vector being serviced (-1 for none)
+    avr_cycle_count_t isr_entry;
+    avr_cycle_count_t isr_max[VECTORS];
+    unsigned long isr_count[VECTORS];
+}bench_t;
+
+static bench_t bench;
+
+// simavr has no PLL model, report it locked so the timer 1 set up doesn't hang
+static void pllcsr_write(struct avr_t * avr, avr_io_addr_t addr, uint8_t v, void * param)
+{
+    (void)param;
+    avr->data[addr] = v | PLOCK;
+}
+
+/*
+ * Moves timer 1 onto PCK: simavr keeps the prescaler of each clock select as a shift of the system clock, two less is
+ * four times as fast
+ */
+static int timer1_on_pck(avr_t * avr)
+{
+    avr_io_t * port;
+    int i;
+
+    for(port = avr->io_port; port; port = port->next)
+    {
+        avr_timer_t * timer = (avr_timer_t *)port;
+
+        if(strcmp(port->kind, "timer") || (timer->name != '1')){
+            continue;
+        }
+        for(i = 0; i < 16; i++)
+        {
+            if(timer->cs_div[i] >= PCK_SHIFT){
+                timer->cs_div[i] -= PCK_SHIFT;
+            }
+        }
+        return 0;
+    }
+    return -1;
+}
+
+static gate_t * gate_on_pin(int pin)
+{
+    int i;
+
+    for(i = 0; i < LIGHTS; i++)
+    {
+        if(bench.gate[i].pin == pin){
+            return &bench.gate[i];
+        }
+    }
+    return NULL;
+}
+
+static void gate_edge(gate_t * gate, uint32_t value)
+{
+    if(value && (gate->rise == 0)){
+        gate->rise = bench.avr->cycle;
+    }
+}
+
+static int oc1_connected(int pin)
+{
+    int i;
+
+    for(i = 0; i < 2; i++)
+    {
+        if((bench.oc1[i].pin == pin) && (bench.oc1[i].com & COM1_CONNECTED)){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The compare action (set or clear) of a connected output, at a match or a FOC1x strobe
+static void oc1_action(oc1_t * oc)
+{
+    uint8_t out;
+    gate_t * gate;
+
+    if(!(oc->com & COM1_CONNECTED)){
+        return;
+    }
+    out = (oc->com & COM1_SET) ? 1 : 0;
+    if(out == oc->out){
+        return;
+    }
+    oc->out = out;
+    gate = gate_on_pin(oc->pin);
+    if(gate){
+        gate_edge(gate, out);
+    }
+}
+
+static void tccr1_written(struct avr_irq_t * irq, uint32_t value, void * param)
+{
+    (void)irq; (void)param;
+    bench.oc1[0].com = (value >> COM1_SHIFT) & 0x03;
+    bench.tcnt1_shift = -1;             // The clock select may have changed, looked up again at the next step
+}
+
+static void gtccr_written(struct avr_irq_t * irq, uint32_t value, void * param)
+{
+    (void)irq; (void)param;
+    bench.oc1[1].com = (value >> COM1_SHIFT) & 0x03;
+    if(value & FOC1A){
+        oc1_action(&bench.oc1[0]);
+    }
+    if(value & FOC1B){
+        oc1_action(&bench.oc1[1]);
+    }
+}
+
+static void tcnt1_written(struct avr_irq_t * irq, uint32_t value, void * param)
+{
+    (void)irq; (void)param;
+    bench.tcnt1_ticks = value;
+    bench.tcnt1_base = bench.avr->cycle - ((avr_cycle_count_t)value << (bench.tcnt1_shift > 0 ? bench.tcnt1_shift : 0));
+}
+
+static void ocr1_written(struct avr_irq_t * irq, uint32_t value, void * param)
+{
+    (void)irq;
+    ((oc1_t *)param)->ocr = (uint8_t)value;
+}
+
+// Cycles a timer 1 tick takes (as a shift), -1 while it is stopped
+static int timer1_shift(void)
+{
+    static const int pck_shift[16] = {-1, 0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+    static const int clk_shift[3] = {-1, 0, 1};     // PCK/1 and /2 aren't shifted, see the notes at the top
+    int cs = bench.avr->data[TCCR1_DATA_ADDR] & 0x0F;
+
+    return (cs < 3) ? clk_shift[cs] : pck_shift[cs];
+}
+
+/*
+ * Steps the modelled timer 1 up to now and carries out the compare matches it passed
+ */
+static void timer1_step(void)
+{
+    avr_cycle_count_t ticks;
+    avr_cycle_count_t t;
+    int i;
+
+    if(bench.tcnt1_shift < 0)
+    {
+        bench.tcnt1_shift = timer1_shift();
+        if(bench.tcnt1_shift < 0){
+            return;
+        }
+        bench.tcnt1_base = bench.avr->cycle - (bench.tcnt1_ticks << bench.tcnt1_shift);
+    }
+
+    ticks = (bench.avr->cycle - bench.tcnt1_base) >> bench.tcnt1_shift;
+    for(t = bench.tcnt1_ticks + 1; t <= ticks; t++)
+    {
+        for(i = 0; i < 2; i++)
+        {
+            if((uint8_t)t == bench.oc1[i].ocr){
+                oc1_action(&bench.oc1[i]);
+            }
+        }
+    }
+    bench.tcnt1_ticks = ticks;
+}
+
+static void oc1_init(void)
+{
+    static const avr_io_addr_t ocr_addr[2] = {OCR1A_DATA_ADDR, OCR1B_DATA_ADDR};
+    static const int oc1_pin[2] = {1, 4};       // PB1, PB4
+    int i;
+
+    for(i = 0; i < 2; i++)
+    {
+        bench.oc1[i].pin = oc1_pin[i];
+        avr_irq_register_notify(avr_iomem_getirq(bench.avr, ocr_addr[i], NULL, AVR_IOMEM_IRQ_ALL),
+                                ocr1_written, &bench.oc1[i]);
+    }
+    bench.tcnt1_shift = -1;
+    avr_irq_register_notify(avr_iomem_getirq(bench.avr, TCCR1_DATA_ADDR, NULL, AVR_IOMEM_IRQ_ALL),
+                            tccr1_written, NULL);
+    avr_irq_register_notify(avr_iomem_getirq(bench.avr, GTCCR_DATA_ADDR, NULL, AVR_IOMEM_IRQ_ALL),
+                            gtccr_written, NULL);
+    avr_irq_register_notify(avr_iomem_getirq(bench.avr, TCNT1_DATA_ADDR, NULL, AVR_IOMEM_IRQ_ALL),
+                            tcnt1_written, NULL);
+}
+
+static int expected_delay_valid(int level)
+{
+    return (level > AC_DIM_MIN_PERCENT) && (level < AC_DIM_MAX_PERCENT);
+}
+
+static double expected_delay_us(int level)
+{
+    double half_cycle_us = 1000000.0 / (2.0 * bench.sc->mains_hz);
+    return half_cycle_us * (100 - level) / 100.0;
+}
+
+// Where the light's compare sits this half cycle, the firmware keeps levels outside the min/max just outside them
+static double compare_delay_us(int level)
+{
+    level = (level > AC_DIM_MAX_PERCENT) ? AC_DIM_MAX_PERCENT + 1 : level;
+    level = (level < AC_DIM_MIN_PERCENT) ? AC_DIM_MIN_PERCENT - 1 : level;
+    return expected_delay_us(level);
+}
+
+// PORTB side of a gate pin, not what the pin shows while a compare output has it
+static void gate_changed(struct avr_irq_t * irq, uint32_t value, void * param)
+{
+    gate_t * gate = (gate_t *)param;
+    (void)irq;
+
+    if(!oc1_connected(gate->pin)){
+        gate_edge(gate, value);
+    }
+}
+
+// Scores the half cycle that just ended for each gate, then starts the next one
+static void zero_cross_edge(void)
+{
+    int i;
+
+    for(i = 0; i < LIGHTS; i++)
+    {
+        gate_t * gate = &bench.gate[i];
+
+        if((bench.half_cycle_count > 1) && !gate->unsure && expected_delay_valid(gate->level) && gate->rise)
+        {
+            double error = CYCLES_TO_US(gate->rise - bench.zc_time) - expected_delay_us(gate->level);
+            error = (error < 0) ? -error : error;
+
+            gate->error_sum_us += error;
+            gate->error_samples++;
+            if(error > gate->error_max_us){
+                gate->error_max_us = error;
+            }
+            if(gate->awaiting_apply && (error <= bench.sc->fire_error_limit_us)){
+                gate->awaiting_apply = 0;       // The written level made it to the gate
+            }
+        }
+        gate->rise = 0;
+
+        if(gate->unsure && (gate->pending_half_cycles < 0) && !gate->ramping){
+            gate->unsure = 0;       // Both ways it could have gone have come together again
+        }
+        if(gate->pending_half_cycles >= 0 && ++gate->pending_half_cycles >= gate->settle_half_cycles)
+        {
+            int from_off = (gate->level <= AC_DIM_MIN_PERCENT);
+
+            // A light coming on from off climbs to its level, a new level part way up carries on climbing
+            gate->target = gate->pending_level;
+            gate->ramping = SOFT_START_STEP && (from_off || gate->ramping) && (gate->target > gate->level);
+            if(!gate->ramping){
+                gate->level = gate->target;
+            }else if(from_off){
+                gate->level = AC_DIM_MIN_PERCENT;
+            }
+            gate->pending_half_cycles = -1;
+        }
+        if(gate->ramping)
+        {
+            gate->level += SOFT_START_STEP;
+            if(gate->level >= gate->target)
+            {
+                gate->level = gate->target;
+                gate->ramping = 0;
+            }
+        }
+        if(gate->awaiting_apply && (--gate->awaiting_apply == 0)){
+            bench.packets_lost++;
+        }
+    }
+
+    bench.zc_time = bench.avr->cycle;
+    bench.half_cycle_count++;
+}
+
+static void i2c_queue_packet(uint8_t light, uint8_t level)
+{
+    i2c_master_t * m = &bench.i2c;
+
+    m->bytes[0] = I2C_ADDRESS << 1;     // Write
+    m->bytes[1] = light;
+    m->bytes[2] = level;
+    m->byte_index = 0;
+    m->bit_index = 0;
+    m->acked = 0;
+    m->phase = I2C_START;
+    m->next = bench.avr->cycle;
+}
+
+// The firmware ACKs by turning SDA into an (low) output on the ninth clock
+static int i2c_slave_acked(void)
+{
+    avr_ioport_state_t state;
+
+    avr_ioctl(bench.avr, AVR_IOCTL_IOPORT_GETSTATE('B'), &state);
+    return (state.ddr & (1 << I2C_SDA_PIN)) != 0;
+}
+
+static void i2c_step(void)
+{
+    i2c_master_t * m = &bench.i2c;
+
+    if((m->phase == I2C_IDLE) || (bench.avr->cycle < m->next)){
+        return;
+    }
+    m->next = bench.avr->cycle + m->quarter;
+
+    switch(m->phase)
+    {
+        case I2C_START:
+            avr_raise_irq(bench.sda_irq, 0);            // SDA falls while SCL is high
+            m->phase = I2C_BIT_LOW;
+            m->next += m->quarter;
+            break;
+
+        case I2C_BIT_LOW:
+            avr_raise_irq(bench.scl_irq, 0);
+            if(m->bit_index < 8){
+                avr_raise_irq(bench.sda_irq, (m->bytes[m->byte_index] >> (7 - m->bit_index)) & 1);
+            }else{
+                avr_raise_irq(bench.sda_irq, 1);        // Release SDA for the ACK
+            }
+            m->phase = I2C_BIT_HIGH;
+            break;
+
+        case I2C_BIT_HIGH:
+            avr_raise_irq(bench.scl_irq, 1);
+            if(m->bit_index == 8)
+            {
+                m->acked += i2c_slave_acked();
+                m->bit_index = 0;
+                if(++m->byte_index == 3){
+                    m->phase = I2C_STOP_LOW;
+                    break;
+                }
+            }
+            else
+            {
+                m->bit_index++;
+            }
+            m->phase = I2C_BIT_LOW;
+            m->next += m->quarter;
+            break;
+
+        case I2C_STOP_LOW:
+            avr_raise_irq(bench.scl_irq, 0);
+            avr_raise_irq(bench.sda_irq, 0);
+            m->phase = I2C_STOP_HIGH;
+            break;
+
+        case I2C_STOP_HIGH:
+        default:
+        {
+            avr_raise_irq(bench.scl_irq, 1);
+            avr_raise_irq(bench.sda_irq, 1);            // SDA rises while SCL is high
+            m->phase = I2C_IDLE;
+
+            if(m->acked == 3)
+            {
+                gate_t * gate = &bench.gate[m->bytes[1]];
+                avr_cycle_count_t now = bench.avr->cycle;
+                avr_cycle_count_t compare = bench.zc_time + US_TO_CYCLES(compare_delay_us(gate->level));
+                avr_cycle_count_t margin = US_TO_CYCLES(COMPARE_MARGIN_US);
+
+                gate->pending_level = m->bytes[2];
+                gate->pending_half_cycles = 0;
+                gate->settle_half_cycles = (now + margin < compare) ? 1 : 2;
+                gate->unsure |= (now + margin >= compare) && (now < compare + margin);
+                gate->awaiting_apply = APPLY_HALF_CYCLES;
+            }
+            else
+            {
+                bench.packets_nacked++;
+            }
+            break;
+        }
+    }
+}
+
+static void track_interrupts(void)
+{
+    avr_t * avr = bench.avr;
+    uint16_t opcode;
+
+    if((bench.isr_vector < 0) && (avr->pc > 0) && (avr->pc < VECTORS * 2) && !(avr->pc & 1))
+    {
+        bench.isr_vector = avr->pc / 2;
+        bench.isr_entry = avr->cycle;
+        return;
+    }
+
+    opcode = avr->flash[avr->pc] | (avr->flash[avr->pc + 1] << 8);
+    if((bench.isr_vector >= 0) && (opcode == RETI_OPCODE))
+    {
+        avr_cycle_count_t cycles = avr->cycle - bench.isr_entry + 4;   // Plus the reti itself
+
+        if(cycles > bench.isr_max[bench.isr_vector]){
+            bench.isr_max[bench.isr_vector] = cycles;
+        }
+        bench.isr_count[bench.isr_vector]++;
+        bench.isr_vector = -1;
+    }
+}
+
+static void run_events(void)
+{
+    avr_cycle_count_t now = bench.avr->cycle;
+
+    timer1_step();
+    if(now >= bench.next_zc)
+    {
+        avr_raise_irq(bench.zc_irq, 1);
+        zero_cross_edge();
+        bench.zc_fall = now + US_TO_CYCLES(ZC_PULSE_US);
+        bench.next_zc += bench.half_cycle;
+    }
+    if(bench.zc_fall && (now >= bench.zc_fall))
+    {
+        avr_raise_irq(bench.zc_irq, 0);
+        bench.zc_fall = 0;
+    }
+
+    if(bench.sc->packets_per_s && (now >= bench.next_packet) && (bench.i2c.phase == I2C_IDLE))
+    {
+        uint8_t light = bench.sequence_index % LIGHTS;
+        uint8_t level = level_sequence[(bench.sequence_index / LIGHTS) % sizeof(level_sequence)];
+
+        i2c_queue_packet(light, level);
+        bench.packets_sent++;
+        bench.sequence_index++;
+        bench.next_packet = now + SIM_F_CPU / bench.sc->packets_per_s;
+    }
+    i2c_step();
+}
+
+static int run_scenario(const char * elf_path, const scenario_t * sc)
+{
+    elf_firmware_t firmware;
+    avr_cycle_count_t end;
+    int state = cpu_Running;
+    int failed = 0;
+    int i;
+
+    memset(&firmware, 0, sizeof(firmware));
+    if(elf_read_firmware(elf_path, &firmware) != 0)
+    {
+        fprintf(stderr, "Can't read %s\n", elf_path);
+        return -1;
+    }
+
+    memset(&bench, 0, sizeof(bench));
+    bench.sc = sc;
+    bench.isr_vector = -1;
+    bench.avr = avr_make_mcu_by_name("attiny85");
+    if(bench.avr == NULL)
+    {
+        fprintf(stderr, "simavr has no attiny85 core\n");
+        return -1;
+    }
+    avr_init(bench.avr);
+    avr_load_firmware(bench.avr, &firmware);
+    bench.avr->frequency = SIM_F_CPU;
+    avr_register_io_write(bench.avr, PLLCSR_DATA_ADDR, pllcsr_write, NULL);
+    if(timer1_on_pck(bench.avr) != 0)
+    {
+        fprintf(stderr, "simavr's attiny85 has no timer 1\n");
+        return -1;
+    }
+    oc1_init();
+
+    bench.zc_irq = avr_io_getirq(bench.avr, AVR_IOCTL_IOPORT_GETIRQ('B'), ZERO_CROSS_PIN);
+    bench.sda_irq = avr_io_getirq(bench.avr, AVR_IOCTL_IOPORT_GETIRQ('B'), I2C_SDA_PIN);
+    bench.scl_irq = avr_io_getirq(bench.avr, AVR_IOCTL_IOPORT_GETIRQ('B'), I2C_SCL_PIN);
+    avr_raise_irq(bench.sda_irq, 1);    // Bus idles high (pull ups)
+    avr_raise_irq(bench.scl_irq, 1);
+    avr_raise_irq(bench.zc_irq, 0);
+
+    for(i = 0; i < LIGHTS; i++)
+    {
+        bench.gate[i].pin = light_pin[i];
+        bench.gate[i].pending_half_cycles = -1;
+        avr_irq_register_notify(avr_io_getirq(bench.avr, AVR_IOCTL_IOPORT_GETIRQ('B'), light_pin[i]),
+                                gate_changed, &bench.gate[i]);
+    }
+
+    bench.half_cycle = SIM_F_CPU / (2 * sc->mains_hz);
+    bench.next_zc = US_TO_CYCLES(5000);     // Let the firmware boot first
+    bench.next_packet = bench.next_zc + 4 * bench.half_cycle;
+    bench.i2c.quarter = SIM_F_CPU / (4UL * sc->i2c_hz);
+    end = bench.next_zc + (avr_cycle_count_t)sc->half_cycles * bench.half_cycle;
+
+    while((bench.avr->cycle < end) && (state != cpu_Done) && (state != cpu_Crashed))
+    {
+        track_interrupts();
+        state = avr_run(bench.avr);
+        run_events();
+    }
+
+    // ----- Report -----
+    printf("\n=== %s (%dHz, %d half cycles, %d packets/s @ %dHz SCL) ===\n",
+           sc->name, sc->mains_hz, sc->half_cycles, sc->packets_per_s, sc->i2c_hz);
+    if(state == cpu_Crashed)
+    {
+        printf("  FIRMWARE CRASHED at pc 0x%04x\n", (unsigned)bench.avr->pc);
+        failed = 1;
+    }
+
+    printf("  %-14s %10s %10s\n", "ISR", "count", "max cyc");
+    for(i = 1; i < VECTORS; i++)
+    {
+        if(bench.isr_count[i] == 0){
+            continue;
+        }
+        printf("  %-14s %10lu %10llu%s\n", vector_name[i], bench.isr_count[i],
+               (unsigned long long)bench.isr_max[i],
+               (bench.isr_max[i] > (avr_cycle_count_t)sc->isr_cycles_limit) ? "  OVER LIMIT" : "");
+        failed |= (bench.isr_max[i] > (avr_cycle_count_t)sc->isr_cycles_limit);
+    }
+
+    printf("  %-14s %10s %10s %10s\n", "gate", "fired", "max err us", "mean err us");
+    for(i = 0; i < LIGHTS; i++)
+    {
+        gate_t * gate = &bench.gate[i];
+        double mean = gate->error_samples ? gate->error_sum_us / gate->error_samples : 0.0;
+
+        printf("  light %d (PB%d) %10d %10.1f %10.1f%s\n", i, light_pin[i], gate->error_samples,
+               gate->error_max_us, mean, (gate->error_max_us > sc->fire_error_limit_us) ? "  OVER LIMIT" : "");
+        failed |= (gate->error_max_us > sc->fire_error_limit_us);
+    }
+
+    printf("  I2C packets: %d sent, %d not ACKed, %d never reached the gate\n",
+           bench.packets_sent, bench.packets_nacked, bench.packets_lost);
+    failed |= (bench.packets_nacked != 0) || (bench.packets_lost != 0);
+
+    printf("  %s\n", failed ? "FAIL" : "PASS");
+    return failed;
+}
+
+int main(int argc, char * argv[])
+{
+    size_t i;
+    int ran = 0;
+    int failed = 0;
+
+    if(argc < 2)
+    {
+        fprintf(stderr, "usage: %s <firmware.elf> [scenario]\n", argv[0]);
+        return 2;
+    }
+
+    for(i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+    {
+        if((argc > 2) && strcmp(argv[2], scenarios[i].name)){
+            continue;
+        }
+        if(scenarios[i].mains_hz != MAINS_HZ)
+        {
+            printf("%s: skipped, the firmware is built for %dHz\n", scenarios[i].name, MAINS_HZ);
+            if(argc > 2){
+                return 2;
+            }
+            continue;
+        }
+        ran++;
+        failed |= (run_scenario(argv[1], &scenarios[i]) != 0);
+    }
+
+    if(ran == 0)
+    {
+        fprintf(stderr, "no scenario called %s\n", argv[2]);
+        return 2;
+    }
+    return failed ? 1 : 0;
+}
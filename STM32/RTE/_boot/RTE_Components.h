@@ -0,0 +1,23 @@
+
+/*
+ * Auto generated Run-Time-Environment Configuration File
+ *      *** Do not modify ! ***
+ *
+ * Project: 'boot' 
+ * Target:  'boot' 
+ */
+
+#ifndef RTE_COMPONENTS_H
+#define RTE_COMPONENTS_H
+
+
+/*
+ * Define the Device Header File: 
+ */
+#define CMSIS_device_header "stm32f0xx.h"
+
+/* Keil.Standalone::Device:Startup:1.0.0 */
+#define RTE_DEVICE_STARTUP_STM32F0XX    /* Device Startup for STM32F0 */
+
+
+#endif /* RTE_COMPONENTS_H */
@@ -0,0 +1,62 @@
+#ifndef __BOOT_H
+#define __BOOT_H
+
+#include "stm32f0xx.h"
+
+/*
+ * Flash layout of the F030C6 (32 x 1KB pages):
+ *   0x08000000  bootloader, 5KB     boot.c, built on its own by boot.uvprojx
+ *   0x08001400  exec slot, 13KB     the image that runs, linked here by ac_dimmer.uvprojx
+ *   0x08004800  stage slot, 13KB    updates land here and are only copied over the exec slot once they check out,
+ *                                   so a bad or cut short update leaves the old image running
+ *   0x08007C00  level store, 1KB    level_store.c
+ * The M0 has no VTOR: the bootloader copies the image's vector table to the bottom of SRAM and maps SRAM at 0, so
+ * the application's IRAM starts above that (and the boot request word).
+ */
+#define BOOT_EXEC_SLOT      ((uint32_t)0x08001400)
+#define BOOT_STAGE_SLOT     ((uint32_t)0x08004800)
+#define BOOT_SLOT_SIZE      0x3400
+#define BOOT_TRAILER_SIZE   0x10    // End of the stage slot, length and CRC of the image in it
+#define BOOT_IMAGE_MAX      (BOOT_SLOT_SIZE - BOOT_TRAILER_SIZE)
+
+#define BOOT_VECTORS        48      // 16 core + 32 F030 interrupts
+#define BOOT_SRAM_VECTORS   ((__IO uint32_t *)0x20000000)
+#define BOOT_REQUEST        (*(__IO uint32_t *)0x200000C0)  // Left in SRAM across the reset into the bootloader
+#define BOOT_REQUEST_KEY    0xB007B007
+
+/*
+ * Update over USART1 at BOOT_BAUD (8N1, or the 9 bit RS-485 framing when SERIAL_RS485 is on, led by the node address):
+ *  1. [0xA0, 0x86, 0xB0] to the application resets into the bootloader. With no image to start it is there anyway.
+ *  2. [0xA0, 0xB1, length (4), crc (4)], multi byte values LSB first. The stage slot is erased (up to half a second),
+ *     then the reply is BOOT_ACK, or BOOT_NAK if the image is over BOOT_IMAGE_MAX.
+ *  3. ceil(length / BOOT_CHUNK_SIZE) packets of BOOT_CHUNK_SIZE bytes (the last padded with 0xFF), each followed by
+ *     its CRC (4). Each is answered with BOOT_ACK once it is in, the next can be sent straight away: it arrives in the
+ *     other half of the receive buffer while this one is programmed. BOOT_NAK ends the update.
+ *  4. After the last packet the stage slot is checked against crc, copied over the exec slot and checked again.
+ *     The reply is BOOT_ACK and the new image starts, or BOOT_NAK and the old one is still there.
+ * The CRCs are CRC-32 as zlib's crc32(). The bootloader gives up waiting for step 2 after BOOT_WAIT_MS and starts
+ * the image, unless it has none.
+ * On RS-485 the update runs at the bus baud (SERIAL_BAUD), so it can go over the bus with every other dimmer still on
+ * it: the update is all data characters (9th bit clear), which the others ignore, just as they do a frame for
+ * another address. It is slower, a full image takes ~15s at 9600. Falling edges still wake dimmers in standby (EXTI3
+ * on Rx), they go back to sleep after STANDBY_TIMEOUT_MS.
+ */
+#define BOOT_CMD            0x86    // Application command, with BOOT_CMD_KEY as the value
+#define BOOT_CMD_KEY        0xB0
+#define BOOT_CMD_START      0xB1
+// SERIAL_RS485 and SERIAL_BAUD are in main.h, include it first
+#ifdef SERIAL_RS485
+#define BOOT_BAUD           SERIAL_BAUD
+#define BOOT_CHAR_BITS      11      // Start, 9 data, stop
+#else
+#define BOOT_BAUD           115200
+#define BOOT_CHAR_BITS      10
+#endif
+#define BOOT_CHUNK_SIZE     512
+#define BOOT_ACK            0x79
+#define BOOT_NAK            0x1F
+#define BOOT_WAIT_MS        3000
+// A packet's time on the wire (45ms at 115200, 590ms at 9600 on RS-485) and some slack for the host
+#define BOOT_PACKET_TIMEOUT_MS  (((BOOT_CHUNK_SIZE + 4) * BOOT_CHAR_BITS * 1000UL) / BOOT_BAUD + 150)
+
+#endif /* __BOOT_H */
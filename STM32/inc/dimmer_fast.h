@@ -0,0 +1,127 @@
+#ifndef __DIMMER_FAST_H
+#define __DIMMER_FAST_H
+
+#include "stm32f0xx.h"
+
+/*
+ * Register level versions of the StdPeriph calls made in the dimmer ISRs (stm32f0xx_it.c).
+ * The project builds at -O0, where a plain inline is still a call, so these are forced inline.
+ * With FAST_HAL commented out they go back to the StdPeriph calls, for comparing the ISR_PROFILE numbers.
+ * Include after main.h, which has the switches.
+ *
+ * TIM3_IRQHandler entry to the BSRR write for light 1, -O0, counted by hand from the C (Cortex-M0 timings, no flash
+ * wait states at 8MHz), not from compiler output. They haven't been measured: take them to +-30% until ISR_PROFILE
+ * (report 0x02) has been read off a board.
+ *   FAST_HAL     ~80 instructions, ~130 cycles (~16us)
+ *   StdPeriph   ~110 instructions, ~190 cycles (~24us)   three calls, TIM_GetITStatus() alone is ~65 cycles
+ * The 16 cycle exception entry comes on top. Lights 2 and 3 add a missed status check per light before them,
+ * ~40 cycles each with FAST_HAL and ~75 without. Loading the next compare after the gate write is a dim_ccr lookup,
+ * the 32 bit divide in Calc_Dim_CCR() (~400 cycles in the library) is done once for every level at start up.
+ */
+#if defined(__CC_ARM)
+#define FAST_INLINE     static __forceinline
+#else
+#define FAST_INLINE     static inline __attribute__((always_inline))
+#endif
+
+#ifdef FAST_HAL
+// Both the flag and its interrupt enable, as TIM_GetITStatus()
+FAST_INLINE uint8_t Fast_TIM_GetITStatus(TIM_TypeDef * TIMx, uint16_t it)
+{
+    return (TIMx->SR & TIMx->DIER & it) != 0;
+}
+
+// rc_w0 bits, writing the others as 1 leaves them alone
+FAST_INLINE void Fast_TIM_ClearIT(TIM_TypeDef * TIMx, uint16_t it)
+{
+    TIMx->SR = (uint16_t)~it;
+}
+
+// Counter and prescaler back to 0 (writing CNT leaves the prescaler part way through a tick). Needs URS set, so the
+// update event doesn't also raise the update interrupt.
+FAST_INLINE void Fast_TIM_Restart(TIM_TypeDef * TIMx)
+{
+    TIMx->EGR = TIM_EGR_UG;
+}
+
+FAST_INLINE uint16_t Fast_TIM_GetCounter(TIM_TypeDef * TIMx)
+{
+    return (uint16_t)TIMx->CNT;
+}
+
+FAST_INLINE void Fast_GPIO_Set(GPIO_TypeDef * GPIOx, uint16_t pin)
+{
+    GPIOx->BSRR = pin;
+}
+
+FAST_INLINE void Fast_GPIO_Reset(GPIO_TypeDef * GPIOx, uint16_t pin)
+{
+    GPIOx->BRR = pin;
+}
+
+FAST_INLINE uint8_t Fast_EXTI_GetITStatus(uint32_t line)
+{
+    return (EXTI->PR & line) != 0;
+}
+
+// Write 1 to clear
+FAST_INLINE void Fast_EXTI_ClearIT(uint32_t line)
+{
+    EXTI->PR = line;
+}
+#else
+#define Fast_TIM_GetITStatus(TIMx, it)      (TIM_GetITStatus(TIMx, it) != RESET)
+#define Fast_TIM_ClearIT(TIMx, it)          TIM_ClearITPendingBit(TIMx, it)
+#define Fast_TIM_Restart(TIMx)              TIM_GenerateEvent(TIMx, TIM_EventSource_Update)
+#define Fast_TIM_GetCounter(TIMx)           ((uint16_t)TIM_GetCounter(TIMx))
+#define Fast_GPIO_Set(GPIOx, pin)           GPIO_SetBits(GPIOx, pin)
+#define Fast_GPIO_Reset(GPIOx, pin)         GPIO_ResetBits(GPIOx, pin)
+#define Fast_EXTI_GetITStatus(line)         (EXTI_GetITStatus(line) != RESET)
+#define Fast_EXTI_ClearIT(line)             EXTI_ClearITPendingBit(line)
+#endif
+
+#ifdef ISR_PROFILE
+/*
+ * Core clock cycles from the start of TIM3_IRQHandler to the gate pin write, read off SysTick (the M0 has no DWT cycle
+ * counter). SysTick counts down from its 1ms reload. The 16 cycle exception entry before the first instruction
+ * isn't included.
+ */
+typedef struct{
+    uint16_t count;
+    uint16_t last;
+    uint16_t max;
+}isr_profile_t;
+
+extern volatile isr_profile_t isr_profile;
+extern volatile uint32_t isr_profile_start;
+
+FAST_INLINE void Profile_Start(void)
+{
+    isr_profile_start = SysTick->VAL;
+}
+
+FAST_INLINE void Profile_Gate(void)
+{
+    uint32_t now = SysTick->VAL;
+    uint32_t cycles = isr_profile_start - now;
+
+    if(now > isr_profile_start)
+    {
+        cycles += SysTick->LOAD + 1;    // Reloaded in between
+    }
+    isr_profile.last = (cycles > 0xFFFF) ? 0xFFFF : (uint16_t)cycles;
+    if(isr_profile.last > isr_profile.max)
+    {
+        isr_profile.max = isr_profile.last;
+    }
+    if(isr_profile.count < 0xFFFF)
+    {
+        isr_profile.count++;
+    }
+}
+#else
+#define Profile_Start()
+#define Profile_Gate()
+#endif
+
+#endif /* __DIMMER_FAST_H */
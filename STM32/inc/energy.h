@@ -0,0 +1,21 @@
+#ifndef __ENERGY_H
+#define __ENERGY_H
+
+#include "stm32f0xx.h"
+
+// Lamp wattage of each light at full conduction, set with CMD_SET_WATTAGE (kept in the level store). 0 leaves the
+// light out of the estimate.
+#define ENERGY_WATTS_DEFAULT    0
+
+typedef struct{
+    uint16_t watts[3];
+    uint16_t power_w[3];        // Estimated power now
+    uint32_t energy_mwh[3];     // Estimated energy, kept over power cuts in the level store
+}energy_t;
+
+extern volatile energy_t energy;
+
+void Energy_SetWatts(uint8_t light, uint16_t watts);
+void Energy_Tick(void);
+
+#endif /* __ENERGY_H */
@@ -0,0 +1,15 @@
+#ifndef __FLASH_H
+#define __FLASH_H
+
+#include "stm32f0xx.h"
+
+// No StdPeriph flash driver in the project, these drive the FLASH registers directly. Shared by the level store and
+// the bootloader (boot.c), so they stay free of anything else in the application.
+#define FLASH_PAGE_SIZE     0x400
+
+void Flash_Unlock(void);
+void Flash_Lock(void);
+void Flash_Program(uint32_t address, uint16_t data);
+void Flash_ErasePage(uint32_t address);
+
+#endif /* __FLASH_H */
@@ -0,0 +1,14 @@
+#ifndef __LEVEL_STORE_H
+#define __LEVEL_STORE_H
+
+#include "stm32f0xx.h"
+
+// Last 1KB flash page of the F030C6, below it are the bootloader and the image slots (see boot.h)
+#define LEVEL_STORE_PAGE    ((uint32_t)0x08007C00)
+#define LEVEL_STORE_SIZE    0x400
+
+uint8_t Level_Store_Load(volatile uint8_t * level, uint8_t * groups);
+void Level_Store_Save(const volatile uint8_t * level, const uint8_t * groups);
+void Level_Store_Compact(void);
+
+#endif /* __LEVEL_STORE_H */
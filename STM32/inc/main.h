@@ -1,7 +1,86 @@
 
 
+// Mains frequency, 50 or 60. The half cycle every firing point is timed from, and the window zero crosses have to fall
+// in: mains at the other frequency is never locked onto, the gates stay off and REPORT_MAINS shows it lost.
+#define MAINS_HZ				50
+
 // PSC = ceil((8Mhz x 20ms / 0xFFFF) - 1)
 #define AC_DIM_PRESCALER 		2
 #define AC_DIM_MIN_PERCENT	20
 #define AC_DIM_MAX_PERCENT	95
 
+// Gate drive: 0 holds the gate from the firing point to the zero cross, otherwise the gate gets a pulse this long
+// followed by GATE_RETRIGGER_PULSES more every GATE_RETRIGGER_US (for inductive and LED loads).
+// Lights at AC_DIM_MAX_PERCENT are always held.
+// Held by default: a short pulse into a load that hasn't reached the holding current yet (LED drivers, transformers)
+// can leave the TRIAC off for the half cycle. Only pulse with a retrigger train, once it is checked on the load.
+#define GATE_PULSE_US			0
+#define GATE_RETRIGGER_PULSES	0
+#define GATE_RETRIGGER_US		1000
+
+// Soft start: a light switched on from off climbs to its level by at most this much (%) a half cycle, which spreads
+// the inrush of cold filaments and transformers. Set per light with 0x30 + light, 0 for none.
+#define SOFT_START_STEP			5
+
+// Light modes, set with light number 0x10 + light
+#define LIGHT_MODE_PHASE		0x00	// Phase angle, fired part way through every half cycle
+#define LIGHT_MODE_BURST		0x01	// Burst fire, whole mains cycles on or off (heaters), the level is the % of cycles on
+
+// Thermal derating from the MCU's internal temperature sensor (it sits on the board with the TRIACs). Above
+// THERMAL_DERATE_C the highest level any light runs at drops THERMAL_DERATE_PER_C % a degree, down to
+// THERMAL_MIN_LEVEL. At THERMAL_CUTOFF_C every light is off until it is THERMAL_HYSTERESIS_C below that again.
+#define THERMAL_DERATE_C		70
+#define THERMAL_DERATE_PER_C	3
+#define THERMAL_MIN_LEVEL		40
+#define THERMAL_CUTOFF_C		100
+#define THERMAL_HYSTERESIS_C	10
+
+// Firing diagnostics: wire the gates back into TIM1 (PA4 -> PA8, PA5 -> PA9, PA6 -> PA10). Every firing is input
+// captured and compared with the compare value it was scheduled at, the stats are read with report 0x01.
+// Comment out for production boards without the loopback.
+//#define FIRING_DIAGNOSTICS
+
+// ISRs use the inlined register accesses in dimmer_fast.h. Comment out for the StdPeriph calls.
+#define FAST_HAL
+
+// ISR profiling: core clock cycles from TIM3_IRQHandler to the gate write, read with report 0x02.
+// Comment out for production, it costs two SysTick reads per compare interrupt.
+//#define ISR_PROFILE
+
+typedef struct{
+    uint16_t count;
+    int16_t min;        // Firing error in TIM3 ticks ((AC_DIM_PRESCALER + 1) / 8MHz = 375ns), capture - scheduled
+    int16_t max;
+    int32_t sum;
+}firing_stats_t;
+
+void Light_SetMode(uint8_t num, uint8_t mode);
+uint8_t Light_GetMode(uint8_t num);
+void Light_SetSoftStart(uint8_t num, uint8_t step);
+uint8_t Light_GetSoftStart(uint8_t num);
+void Light_SetLevel(uint8_t num, uint8_t level);
+void Light_SetCap(uint8_t cap);
+void Zero_Cross_Init(void);
+void Standby_Prepare(void);
+void Standby_Resume(void);
+uint8_t Defer_Lights(uint8_t light_mask, uint8_t level, uint8_t half_cycle);
+uint8_t Defer_Pending(void);
+
+extern volatile uint8_t half_cycle_count;
+extern volatile uint8_t light_level[3];
+extern uint8_t light_groups[3];
+extern volatile uint8_t level_cap;
+extern volatile firing_stats_t firing_stats[3];
+
+#define SERIAL_BAUD				9600	// USART1, the bootloader runs at this too on an RS-485 bus (see boot.h)
+
+// RS-485 multi-drop bus on USART1, with the transceiver driver enable on PA12 (DE).
+// Each frame is sent as 9 bit characters, led by an address character (9th bit set, the address in the low 7 bits).
+// A dimmer takes the frames sent to SERIAL_NODE_ADDRESS or SERIAL_BROADCAST_ADDRESS and ignores the rest. It never
+// answers a broadcast (reports, bootloader entry), all the dimmers would talk at once.
+// Comment out for a point to point link (8 bit characters, no address).
+//#define SERIAL_RS485
+#define SERIAL_NODE_ADDRESS		0x01	// 0x01 - 0x7E (0x7F is the standby wake up preamble)
+#define SERIAL_BROADCAST_ADDRESS	0x00	// Every dimmer on the bus
+#define SERIAL_ADDRESS_MARK		0x100	// 9th bit of an address character
+#define SERIAL_DE_TIME			16		// DE lead and lag around each frame, in 1/16 bit times (max 31)
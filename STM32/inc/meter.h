@@ -0,0 +1,32 @@
+#ifndef __METER_H
+#define __METER_H
+
+#include "stm32f0xx.h"
+
+// Inputs, all biased to mid rail (VDDA / 2): mains voltage divider on PA1 (IN1), load current of light 1 - 3 from a
+// shunt or CT on PA7 (IN7), PB0 (IN8) and PB1 (IN9). The scales are for one ADC count (VDDA = 3.3V) in Q8, set them
+// for the front end fitted: the defaults map a 325V mains peak and a 10A load peak to +-1.5V.
+#define METER_VOLTAGE_DV_PER_COUNT_Q8   447     // 0.1V
+#define METER_CURRENT_MA_PER_COUNT_Q8   1375    // mA
+
+// Overcurrent cutoff: a light is switched off after this many half cycles in a row over the limit (rides through the
+// soft started inrush of a cold load)
+#define METER_OVERCURRENT_MA            5000
+#define METER_TRIP_HALF_CYCLES          10
+
+typedef struct{
+    uint16_t voltage_dv;    // Mains RMS over the last half cycle, 0.1V
+    uint16_t current_ma[3]; // Load RMS of each light over the last half cycle
+    uint16_t trips[3];      // Overcurrent cutoffs since boot
+}meter_t;
+
+extern volatile meter_t meter;
+
+void Meter_Init(void);
+uint8_t Meter_Running(void);
+void Meter_ZeroCross(void);
+void Meter_Stop(void);
+void Meter_Start(void);
+uint16_t Meter_TemperatureRaw(void);
+
+#endif /* __METER_H */
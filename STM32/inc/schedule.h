@@ -0,0 +1,28 @@
+#ifndef __SCHEDULE_H
+#define __SCHEDULE_H
+
+#include "stm32f0xx.h"
+
+#define SCHEDULE_ENTRIES    8
+#define SCHEDULE_DISABLED   0xFF    // hour of an unused entry
+#define SCHEDULE_KEEP       0xFF    // level of a light the entry leaves alone
+
+// Time of day trigger: at hour:minute each light fades from where it is to its level over fade_s (0 for a scene cut).
+// The RTC only starts it, the fade is timed in mains half cycles.
+typedef struct{
+    uint8_t hour;
+    uint8_t minute;
+    uint8_t level[3];
+    uint16_t fade_s;
+}schedule_entry_t;
+
+void Schedule_Init(void);
+void Schedule_SetTime(uint8_t hour, uint8_t minute, uint8_t second);
+void Schedule_SetEntry(uint8_t index, const schedule_entry_t * entry);
+void Schedule_CancelFade(uint8_t light);
+uint8_t Schedule_Fading(void);
+void Schedule_HalfCycle(void);
+void Schedule_TrimRestart(void);
+void Schedule_Tick(void);
+
+#endif /* __SCHEDULE_H */
@@ -49,6 +49,8 @@ void SysTick_Handler(void);
 void EXTI4_15_IRQHandler(void);
 void EXTI0_1_IRQHandler(void);
 void EXTI2_3_IRQHandler(void);
+void RTC_IRQHandler(void);
+void TIM1_CC_IRQHandler(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,10 @@
+#ifndef __THERMAL_H
+#define __THERMAL_H
+
+#include "stm32f0xx.h"
+
+extern volatile int16_t thermal_temp_dc;   // Filtered die temperature, 0.1C
+
+void Thermal_Init(void);
+
+#endif /* __THERMAL_H */
@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+# analyse.py
+#
+# Reports on the CSV written by bench.py:
+#   - command to firing latency: end of the command frame to the first gate edge at the new level
+#   - firing jitter: spread of the zero cross to gate delay while the level is steady
+#   - missed half cycles: half cycles a gate should have fired in but didn't
+#   - relock: after a gap in the zero cross (BENCH_DROPOUT) the first edge back only restarts the timing, the gates
+#     have to fire again from the second half cycle. Misses after that count as missed half cycles.
+#   - soft start (BENCH_SOFT_START=1): firings on the way up from off to a commanded level are counted as ramp steps,
+#     and the latency of those commands (to the final level) is reported apart from the others
+# Exits non-zero if any half cycles were missed or a command never showed up on its gate.
+#
+# Usage: python3 analyse.py events.csv [--tolerance-us N]
+
+import argparse
+import os
+import re
+import statistics
+import sys
+
+LIGHTS = 3
+
+
+def build_define(name):
+    with open(os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "inc", "main.h")) as f:
+        return int(re.search(r"#define\s+%s\s+(\d+)" % name, f.read()).group(1))
+
+
+AC_DIM_MIN_PERCENT = build_define("AC_DIM_MIN_PERCENT")
+AC_DIM_MAX_PERCENT = build_define("AC_DIM_MAX_PERCENT")
+
+
+def load(path):
+    params = {}
+    events = []
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if line.startswith("#"):
+                params.update(kv.split("=") for kv in line[1:].split())
+                continue
+            if not line or line.startswith("time_us"):
+                continue
+            t, event, light, value = line.split(",")
+            events.append((float(t), event, int(light), int(value)))
+    return {k: int(v) for k, v in params.items()}, events
+
+
+def fires(level):
+    return AC_DIM_MIN_PERCENT < level < AC_DIM_MAX_PERCENT
+
+
+def expected_delay_us(level, mains_hz):
+    return (100 - level) * 1e6 / (2 * mains_hz * 100)
+
+
+# Level a gate delay is closest to
+def delay_level(delay, mains_hz):
+    return int(round(100 - delay * 2 * mains_hz * 100 / 1e6))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("csv")
+    parser.add_argument("--tolerance-us", type=float, default=50.0,
+                        help="how close a gate edge must be to the expected delay to count as the new level")
+    args = parser.parse_args()
+
+    params, events = load(args.csv)
+    mains_hz = params.get("mains_hz", 50)
+
+    level = [0] * LIGHTS
+    pending = [None] * LIGHTS       # (command time, level) waiting to show up on the gate
+    fired = [False] * LIGHTS
+    zc_time = None
+    half_cycles = 0
+    missed = [0] * LIGHTS
+    latencies = []
+    ramp_latencies = []             # Commands that came in through the soft start
+    ramping = [False] * LIGHTS
+    ramp_steps = 0
+    lost = 0
+    steady_delays = [[] for _ in range(LIGHTS)]
+    half_cycle_us = 1e6 / (2 * mains_hz)
+    relocking = False               # In the half cycle after the first edge back, the gates aren't fired
+    relocks = 0
+
+    for t, event, light, value in events:
+        if event == "zc":
+            if zc_time is not None and t - zc_time > 1.5 * half_cycle_us:
+                relocking = True
+                relocks += 1
+            elif zc_time is not None and not relocking:
+                for i in range(LIGHTS):
+                    if fires(level[i]) and not fired[i]:
+                        missed[i] += 1
+            else:
+                relocking = False
+            zc_time = t
+            half_cycles += 1
+            fired = [False] * LIGHTS
+
+        elif event == "cmd":
+            if pending[light] is not None:
+                lost += 1       # Overwritten before it was ever seen
+            pending[light] = (t, value)
+
+        elif event == "gate" and value == 1 and zc_time is not None:
+            fired[light] = True
+            delay = t - zc_time
+
+            if pending[light] is not None:
+                cmd_t, new_level = pending[light]
+                if abs(delay - expected_delay_us(new_level, mains_hz)) <= args.tolerance_us:
+                    (ramp_latencies if ramping[light] else latencies).append(t - cmd_t)
+                    ramping[light] = False
+                    level[light] = new_level
+                    pending[light] = None
+                    continue
+
+                # A step of the soft start, from off up towards the new level
+                step = delay_level(delay, mains_hz)
+                if (not fires(level[light]) and AC_DIM_MIN_PERCENT < step < new_level and
+                        abs(delay - expected_delay_us(step, mains_hz)) <= args.tolerance_us):
+                    ramping[light] = True
+                    ramp_steps += 1
+                    continue
+
+            if abs(delay - expected_delay_us(level[light], mains_hz)) <= args.tolerance_us:
+                steady_delays[light].append(delay - expected_delay_us(level[light], mains_hz))
+
+    lost += sum(p is not None for p in pending)
+
+    print("mains %dHz, %d half cycles, %d commands/s, soft start %s" %
+          (mains_hz, half_cycles, params.get("cmd_rate", 0), "on" if params.get("soft_start", 0) else "off"))
+    if latencies:
+        print("command to firing latency: min %.0fus, mean %.0fus, max %.0fus (%d commands)" %
+              (min(latencies), statistics.mean(latencies), max(latencies), len(latencies)))
+    if ramp_latencies:
+        print("soft start: command to final level latency: min %.0fus, mean %.0fus, max %.0fus (%d commands, "
+              "%d ramp firings)" % (min(ramp_latencies), statistics.mean(ramp_latencies), max(ramp_latencies),
+                                    len(ramp_latencies), ramp_steps))
+    for i in range(LIGHTS):
+        d = steady_delays[i]
+        if len(d) > 1:
+            print("light %d firing error: mean %+.1fus, jitter %.1fus p-p, %.1fus std dev, %d missed half cycles" %
+                  (i, statistics.mean(d), max(d) - min(d), statistics.stdev(d), missed[i]))
+        else:
+            print("light %d: not enough firings to measure, %d missed half cycles" % (i, missed[i]))
+    print("commands never seen on the gate: %d" % lost)
+    if params.get("dropout", 0):
+        print("zero cross dropouts: %d" % relocks)
+
+    return 1 if (lost or any(missed)) else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
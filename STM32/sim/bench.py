@@ -0,0 +1,127 @@
+# bench.py
+#
+# Runs inside Renode (loaded by ac_dimmer.resc). Drives the zero cross input and USART1,
+# and records every zero cross, command and gate edge to a CSV for analyse.py.
+#
+# Scenario (environment variables):
+#   BENCH_MAINS_HZ      Mains frequency (default MAINS_HZ from inc/main.h). The firmware only locks onto the
+#                       frequency it was built for, a run at the other one is refused.
+#   BENCH_HALF_CYCLES   Length of the run (default 500)
+#   BENCH_CMD_RATE      Commands per second, 0 for none (default 10)
+#   BENCH_LIGHTS        Lights the commands cycle through (default 3)
+#   BENCH_DROPOUT       Half cycles of zero cross pulses left out to test the dropout and relock, 0 for none
+#                       (default 0). Over 3 (24.6ms at 50Hz) for the firmware to see it as a dropout.
+#   BENCH_DROPOUT_AT    Half cycle the dropout starts at (default half way through the run)
+#   BENCH_SOFT_START    1 to leave the soft start on, analyse.py then reports the ramps on their own. 0 sets every
+#                       light's step to 0 before the run, so each command goes straight to its level (default 0)
+#   BENCH_OUT           CSV to write (default sim/events.csv)
+
+import os
+import re
+
+COMMAND_HEADER = 0xA0
+CMD_SOFT_START = 0x30           # + light, step
+STANDBY_PREAMBLE = 0xFF         # Wakes the firmware from standby, the byte itself is lost
+ZC_PULSE_S = 0.0002             # Width of the zero cross detector pulse
+UART_BYTE_S = 10.0 / 9600       # One start, 8 data and one stop bit at 9600 baud
+BOOT_S = 0.005                  # Let the firmware set up before the first zero cross
+
+# Levels the commands walk through, all between AC_DIM_MIN_PERCENT and AC_DIM_MAX_PERCENT
+LEVEL_SEQUENCE = [30, 50, 70, 90, 60, 40, 25, 80]
+
+
+def env(name, default):
+    return type(default)(os.environ.get(name, default))
+
+
+def build_mains_hz():
+    with open("inc/main.h") as f:
+        return int(re.search(r"#define\s+MAINS_HZ\s+(\d+)", f.read()).group(1))
+
+
+def now_us(machine):
+    return machine.ElapsedVirtualTime.TimeElapsed.TotalMicroseconds
+
+
+def run_for(seconds):
+    if seconds > 0:
+        monitor.Parse('emulation RunFor "%.7f"' % seconds)
+
+
+def bench_run():
+    mains_hz = env("BENCH_MAINS_HZ", build_mains_hz())
+    if mains_hz != build_mains_hz():
+        print("BENCH_MAINS_HZ=%d: skipped, the firmware is built for %dHz (MAINS_HZ)" % (mains_hz, build_mains_hz()))
+        return
+    half_cycles = env("BENCH_HALF_CYCLES", 500)
+    cmd_rate = env("BENCH_CMD_RATE", 10)
+    lights = env("BENCH_LIGHTS", 3)
+    dropout = env("BENCH_DROPOUT", 0)
+    dropout_at = env("BENCH_DROPOUT_AT", half_cycles // 2)
+    soft_start = env("BENCH_SOFT_START", 0)
+    out_path = env("BENCH_OUT", "sim/events.csv")
+
+    machine = monitor.Machine
+    usart = machine["sysbus.usart1"]
+    events = []
+
+    def gate_handler(light):
+        return lambda led, state: events.append((now_us(machine), "gate", light, 1 if state else 0))
+
+    for light in range(3):
+        machine["sysbus.gpioPortA.gate%d" % light].StateChanged += gate_handler(light)
+
+    def send(data):
+        for byte in data:
+            usart.WriteChar(byte)
+            run_for(UART_BYTE_S)
+        return len(data) * UART_BYTE_S
+
+    half_cycle_s = 1.0 / (2 * mains_hz)
+    cmd_period_s = (1.0 / cmd_rate) if cmd_rate else None
+    t = 0.0
+    cmd_index = 0
+
+    run_for(BOOT_S)
+    t = BOOT_S
+
+    # Soft start off, it holds back the first command to each light (from off) over several half cycles
+    if not soft_start:
+        t += send([STANDBY_PREAMBLE])
+        for light in range(3):
+            t += send([COMMAND_HEADER, CMD_SOFT_START + light, 0])
+    next_cmd_s = t + 4 * half_cycle_s
+
+    for n in range(half_cycles):
+        end_s = t + half_cycle_s
+
+        # Zero cross pulse, unless the mains is out
+        if not (dropout_at <= n < dropout_at + dropout):
+            monitor.Parse("sysbus.gpioPortA OnGPIO 0 true")
+            events.append((now_us(machine), "zc", 0, 0))
+            run_for(ZC_PULSE_S)
+            monitor.Parse("sysbus.gpioPortA OnGPIO 0 false")
+            t += ZC_PULSE_S
+
+        # Commands due this half cycle, each byte at the line rate
+        while cmd_period_s and next_cmd_s < end_s:
+            run_for(max(next_cmd_s, t) - t)
+            t = max(next_cmd_s, t)
+
+            light = cmd_index % lights
+            level = LEVEL_SEQUENCE[(cmd_index // lights) % len(LEVEL_SEQUENCE)]
+            t += send([COMMAND_HEADER, light, level])
+            events.append((now_us(machine), "cmd", light, level))
+
+            cmd_index += 1
+            next_cmd_s += cmd_period_s
+
+        run_for(end_s - t)
+        t = end_s
+
+    with open(out_path, "w") as f:
+        f.write("# mains_hz=%d half_cycles=%d cmd_rate=%d dropout=%d soft_start=%d\n" %
+                (mains_hz, half_cycles, cmd_rate, dropout, soft_start))
+        f.write("time_us,event,light,value\n")
+        for e in sorted(events, key=lambda e: e[0]):
+            f.write("%.2f,%s,%d,%d\n" % e)
@@ -0,0 +1,333 @@
+#include "stm32f0xx.h"
+#include "main.h"
+#include "boot.h"
+#include "flash.h"
+
+/*
+ * Resident bootloader, built by boot.uvprojx into the bottom 5KB (see the layout and update protocol in boot.h).
+ * At reset it finishes copying a checked update from the stage slot if there is one, then starts the exec slot, or
+ * stays to take an update over USART1. Registers only, no StdPeriph drivers, to stay inside the 5KB.
+ * On an RS-485 bus it runs at the bus baud, so the other dimmers ignore the update (see boot.h).
+ */
+
+#define COMMAND_HEADER      0xA0
+#define START_SIZE          10      // 0xA0, BOOT_CMD_START, length (4), crc (4)
+#define PACKET_SIZE         (BOOT_CHUNK_SIZE + 4)
+
+typedef struct{
+    uint32_t length;
+    uint32_t crc;
+    uint32_t check;         // ~length, written last so a trailer cut short doesn't count
+    uint16_t installed;     // Left blank until the image is copied over the exec slot, then programmed to 0
+    uint16_t reserved;
+}boot_trailer_t;
+
+#define STAGE_TRAILER       ((const boot_trailer_t *)(BOOT_STAGE_SLOT + BOOT_IMAGE_MAX))
+
+static volatile uint32_t tick_ms = 0;
+static uint32_t rx[2][PACKET_SIZE / 4];     // Double buffer, DMA1 channel 3 fills it from USART1 in circular mode
+
+
+void SysTick_Handler(void)
+{
+    tick_ms++;
+}
+
+static uint32_t Get_U32(const uint8_t * buf)
+{
+    return buf[0] | (buf[1] << 8) | ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+// zlib's CRC-32 on the CRC unit: its polynomial, input bytes and output bit reversed, inverted at both ends
+static uint32_t Crc_Block(const uint8_t * data, uint32_t len)
+{
+    CRC->INIT = 0xFFFFFFFF;
+    CRC->CR = CRC_CR_REV_IN_0 | CRC_CR_REV_OUT | CRC_CR_RESET;
+    while(len--)
+    {
+        *(__IO uint8_t *)&CRC->DR = *data++;
+    }
+    return ~CRC->DR;
+}
+
+static void Program_Block(uint32_t address, const uint8_t * data, uint32_t len)
+{
+    uint32_t i;
+
+    for(i = 0; i < len; i += 2)
+    {
+        Flash_Program(address + i, data[i] | (data[i + 1] << 8));
+    }
+}
+
+static void Erase_Slot(uint32_t slot)
+{
+    uint32_t address;
+
+    for(address = slot; address < slot + BOOT_SLOT_SIZE; address += FLASH_PAGE_SIZE)
+    {
+        Flash_ErasePage(address);
+    }
+}
+
+// A checked update in the stage slot that hasn't been copied over the exec slot yet
+static uint8_t Stage_Pending(void)
+{
+    const boot_trailer_t * trailer = STAGE_TRAILER;
+
+    return (trailer->check == ~trailer->length) && (trailer->length > 0) && (trailer->length <= BOOT_IMAGE_MAX) &&
+           (trailer->installed == 0xFFFF) && (Crc_Block((const uint8_t *)BOOT_STAGE_SLOT, trailer->length) == trailer->crc);
+}
+
+// Stack pointer in SRAM and reset handler in the slot, a blank or half erased slot fails. Images loaded with the
+// debugger have no trailer, so this is all that is checked before starting one.
+static uint8_t Exec_Valid(void)
+{
+    const uint32_t * vectors = (const uint32_t *)BOOT_EXEC_SLOT;
+
+    return (vectors[0] > SRAM_BASE) && (vectors[0] <= SRAM_BASE + 0x1000) &&
+           (vectors[1] > BOOT_EXEC_SLOT) && (vectors[1] < BOOT_EXEC_SLOT + BOOT_SLOT_SIZE);
+}
+
+static uint8_t Exec_Ready(void)
+{
+    return !Stage_Pending() && Exec_Valid();
+}
+
+/*
+ * Copies the update over the exec slot, and marks it installed once the copy checks out. Cut short by a power cut,
+ * it is still pending at the next reset and starts again.
+ */
+static uint8_t Boot_Install(void)
+{
+    const boot_trailer_t * trailer = STAGE_TRAILER;
+    uint8_t ok;
+
+    Flash_Unlock();
+    Erase_Slot(BOOT_EXEC_SLOT);
+    Program_Block(BOOT_EXEC_SLOT, (const uint8_t *)BOOT_STAGE_SLOT, trailer->length);
+    ok = (Crc_Block((const uint8_t *)BOOT_EXEC_SLOT, trailer->length) == trailer->crc);
+    if(ok)
+    {
+        Flash_Program((uint32_t)&trailer->installed, 0);
+    }
+    Flash_Lock();
+    return ok;
+}
+
+static void Serial_Init(void)
+{
+    RCC->AHBENR |= RCC_AHBENR_GPIOAEN | RCC_AHBENR_DMA1EN | RCC_AHBENR_CRCEN;
+    RCC->APB2ENR |= RCC_APB2ENR_USART1EN;
+
+    // Tx (PA2), Rx (PA3) on AF1, pulled up as InitUSART1()
+    GPIOA->AFR[0] = (GPIOA->AFR[0] & ~(GPIO_AFRL_AFR2 | GPIO_AFRL_AFR3)) | (1 << 8) | (1 << 12);
+    GPIOA->PUPDR = (GPIOA->PUPDR & ~(GPIO_PUPDR_PUPDR2 | GPIO_PUPDR_PUPDR3)) | GPIO_PUPDR_PUPDR2_0 | GPIO_PUPDR_PUPDR3_0;
+    GPIOA->MODER = (GPIOA->MODER & ~(GPIO_MODER_MODER2 | GPIO_MODER_MODER3)) | GPIO_MODER_MODER2_1 | GPIO_MODER_MODER3_1;
+
+    USART1->BRR = (SystemCoreClock + BOOT_BAUD / 2) / BOOT_BAUD;
+    USART1->CR3 = USART_CR3_OVRDIS;     // A lost byte fails the packet CRC, rather than holding up the DMA
+#ifdef SERIAL_RS485
+    // DE (PA12) on AF1
+    GPIOA->AFR[1] = (GPIOA->AFR[1] & ~GPIO_AFRH_AFR12) | (1 << 16);
+    GPIOA->MODER = (GPIOA->MODER & ~GPIO_MODER_MODER12) | GPIO_MODER_MODER12_1;
+
+    USART1->CR1 = USART_CR1_M | USART_CR1_MME | USART_CR1_WAKE | (SERIAL_DE_TIME << 21) | (SERIAL_DE_TIME << 16);
+    USART1->CR2 = ((uint32_t)SERIAL_NODE_ADDRESS << 24) | USART_CR2_ADDM7;
+    USART1->CR3 |= USART_CR3_DEM;
+#endif
+    USART1->CR1 |= USART_CR1_TE | USART_CR1_RE | USART_CR1_UE;
+#ifdef SERIAL_RS485
+    USART1->RQR = USART_RQR_MMRQ;       // Muted until our address, then stays listening for the rest of the update
+#endif
+}
+
+static void Serial_Put(uint8_t data)
+{
+    while(!(USART1->ISR & USART_ISR_TXE));
+    USART1->TDR = data;
+    while(!(USART1->ISR & USART_ISR_TC));
+}
+
+// Waits for the start of an update, returns 0 if timeout_ms (0 for never) runs out first
+static uint8_t Serial_GetStart(uint8_t * buffer, uint32_t timeout_ms)
+{
+    uint32_t start = tick_ms;
+    uint8_t i = 0;
+
+    while(i < START_SIZE)
+    {
+        uint16_t data;
+
+        while(!(USART1->ISR & USART_ISR_RXNE))
+        {
+            if(timeout_ms && ((tick_ms - start) >= timeout_ms)){
+                return 0;
+            }
+        }
+        data = USART1->RDR;
+#ifdef SERIAL_RS485
+        if(data & SERIAL_ADDRESS_MARK){
+            i = 0;
+            continue;
+        }
+#endif
+        buffer[i++] = (uint8_t)data;
+        if((buffer[0] != COMMAND_HEADER) || ((i > 1) && (buffer[1] != BOOT_CMD_START))){
+            i = 0;
+        }
+    }
+    return 1;
+}
+
+static void Rx_Start(void)
+{
+    DMA1_Channel3->CCR = 0;
+    DMA1->IFCR = DMA_IFCR_CGIF3;
+    DMA1_Channel3->CPAR = (uint32_t)&USART1->RDR;
+    DMA1_Channel3->CMAR = (uint32_t)rx;
+    DMA1_Channel3->CNDTR = sizeof(rx);
+    DMA1_Channel3->CCR = DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_EN;     // Bytes, USART to memory
+    USART1->CR3 |= USART_CR3_DMAR;
+}
+
+static void Rx_Stop(void)
+{
+    USART1->CR3 &= ~USART_CR3_DMAR;
+    DMA1_Channel3->CCR = 0;
+}
+
+// Half transfer for the first buffer, transfer complete for the second
+static uint8_t Rx_Wait(uint8_t half)
+{
+    uint32_t flag = half ? DMA_ISR_TCIF3 : DMA_ISR_HTIF3;
+    uint32_t start = tick_ms;
+
+    while(!(DMA1->ISR & flag))
+    {
+        if((tick_ms - start) >= BOOT_PACKET_TIMEOUT_MS){
+            return 0;
+        }
+    }
+    DMA1->IFCR = flag;
+    return 1;
+}
+
+/*
+ * Takes an update into the stage slot. Each packet is acked as soon as it checks out and then programmed (256 half
+ * words at about 50us) while the next one arrives in the other buffer (45ms at 115200), so the link only waits on
+ * the ack turnaround, never on the flash.
+ */
+static uint8_t Boot_Download(const uint8_t * start)
+{
+    uint32_t length = Get_U32(&start[2]);
+    uint32_t crc = Get_U32(&start[6]);
+    uint32_t packets = (length + BOOT_CHUNK_SIZE - 1) / BOOT_CHUNK_SIZE;
+    uint32_t n;
+    uint8_t ok = 1;
+
+    if((length == 0) || (length > BOOT_IMAGE_MAX))
+    {
+        return 0;
+    }
+
+    Flash_Unlock();
+    Erase_Slot(BOOT_STAGE_SLOT);        // Also drops any earlier update's trailer
+    Rx_Start();
+    Serial_Put(BOOT_ACK);
+
+    for(n = 0; ok && (n < packets); n++)
+    {
+        const uint8_t * packet = (const uint8_t *)rx[n & 1];
+        uint32_t offset = n * BOOT_CHUNK_SIZE;
+        uint32_t len = ((length - offset) < BOOT_CHUNK_SIZE) ? (length - offset) : BOOT_CHUNK_SIZE;
+
+        ok = Rx_Wait(n & 1) && (Crc_Block(packet, BOOT_CHUNK_SIZE) == Get_U32(&packet[BOOT_CHUNK_SIZE]));
+        if(ok)
+        {
+            Serial_Put(BOOT_ACK);
+            Program_Block(BOOT_STAGE_SLOT + offset, packet, len);   // The padding after the image isn't written
+        }
+    }
+    Rx_Stop();
+
+    if(ok && (Crc_Block((const uint8_t *)BOOT_STAGE_SLOT, length) == crc))
+    {
+        uint32_t trailer = (uint32_t)STAGE_TRAILER;
+
+        Flash_Program(trailer, length & 0xFFFF);
+        Flash_Program(trailer + 2, length >> 16);
+        Flash_Program(trailer + 4, crc & 0xFFFF);
+        Flash_Program(trailer + 6, crc >> 16);
+        Flash_Program(trailer + 8, ~length & 0xFFFF);
+        Flash_Program(trailer + 10, ~length >> 16);
+    }
+    else
+    {
+        ok = 0;
+    }
+    Flash_Lock();
+    return ok;
+}
+
+/*
+ * Hands over to the image in the exec slot, with the peripherals used here back to their reset state and its
+ * vector table mapped at 0.
+ */
+static void Boot_Start(void)
+{
+    const uint32_t * vectors = (const uint32_t *)BOOT_EXEC_SLOT;
+    uint8_t i;
+
+    SysTick->CTRL = 0;
+    SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
+    Rx_Stop();
+    RCC->APB2RSTR = RCC_APB2RSTR_USART1RST;
+    RCC->APB2RSTR = 0;
+    RCC->AHBRSTR = RCC_AHBRSTR_GPIOARST;
+    RCC->AHBRSTR = 0;
+    RCC->AHBENR &= ~(RCC_AHBENR_GPIOAEN | RCC_AHBENR_DMA1EN | RCC_AHBENR_CRCEN);
+    RCC->APB2ENR &= ~RCC_APB2ENR_USART1EN;
+
+    for(i = 0; i < BOOT_VECTORS; i++)
+    {
+        BOOT_SRAM_VECTORS[i] = vectors[i];
+    }
+    RCC->APB2ENR |= RCC_APB2ENR_SYSCFGEN;
+    SYSCFG->CFGR1 |= SYSCFG_CFGR1_MEM_MODE;     // SRAM at 0
+
+    // Nothing on the stack is used after the switch, the reset vector is read straight from the slot
+    __set_MSP(*(const uint32_t *)BOOT_EXEC_SLOT);
+    ((void (*)(void))(*(const uint32_t *)(BOOT_EXEC_SLOT + 4)))();
+}
+
+int main(void)
+{
+    uint8_t start[START_SIZE];
+    uint8_t requested = (BOOT_REQUEST == BOOT_REQUEST_KEY);
+
+    BOOT_REQUEST = 0;
+    SysTick_Config(SystemCoreClock / 1000);         // tick_ms
+    RCC->AHBENR |= RCC_AHBENR_CRCEN;
+
+    if(Stage_Pending())
+    {
+        Boot_Install();         // A new update, or one whose copy a power cut stopped
+    }
+    if(!requested && Exec_Ready())
+    {
+        Boot_Start();
+    }
+
+    Serial_Init();
+    while(Serial_GetStart(start, Exec_Ready() ? BOOT_WAIT_MS : 0))    // With no image to start, wait for one
+    {
+        if(Boot_Download(start) && Boot_Install())
+        {
+            Serial_Put(BOOT_ACK);
+            break;
+        }
+        Serial_Put(BOOT_NAK);   // The exec slot is as it was (or the update is still pending), the host can start again
+    }
+    Boot_Start();
+}
@@ -0,0 +1,99 @@
+#include "stm32f0xx.h"
+#include "main.h"
+#include "energy.h"
+
+/*
+ * Sensorless energy estimate for resistive loads. A phase angle light fired at angle a into each half cycle delivers
+ * the fraction (pi - a + sin(2a) / 2) / pi of full power (the integral of sin^2 from a to pi). The angle comes from
+ * the committed compare value against the measured half cycle, so it follows the mains as it drifts off MAINS_HZ.
+ * Run from the 1Hz RTC tick, the elapsed time comes from SysTick (the RTC runs off the LSI).
+ */
+
+#define POWER_TABLE_STEPS   64
+
+// Fraction of full power (Q15) at firing angles of 0 - pi in POWER_TABLE_STEPS steps
+static const uint16_t power_table[POWER_TABLE_STEPS + 1] = {
+    32768, 32767, 32761, 32746, 32716, 32666, 32593, 32492,
+    32360, 32191, 31984, 31735, 31442, 31103, 30715, 30278,
+    29791, 29254, 28667, 28031, 27346, 26615, 25840, 25023,
+    24168, 23276, 22353, 21402, 20428, 19434, 18425, 17407,
+    16384, 15361, 14343, 13334, 12340, 11366, 10415,  9492,
+     8600,  7745,  6928,  6153,  5422,  4737,  4101,  3514,
+     2977,  2490,  2053,  1665,  1326,  1033,   784,   577,
+      408,   276,   175,   102,    52,    22,     7,     1,
+        0,
+};
+
+extern volatile uint32_t tick_ms;
+extern volatile uint8_t dim_trans_buf[3];
+extern volatile uint8_t burst_mode[3];
+extern volatile uint16_t half_cycle_ticks;
+uint16_t Calc_Dim_CCR(uint32_t dim);
+
+volatile energy_t energy = {{ENERGY_WATTS_DEFAULT, ENERGY_WATTS_DEFAULT, ENERGY_WATTS_DEFAULT}};
+
+static uint16_t energy_mj[3];           // Carried over, less than a mWh (3600mJ)
+static uint32_t last_tick_ms = 0;
+
+
+void Energy_SetWatts(uint8_t light, uint16_t watts)
+{
+    if(light < 3)
+    {
+        energy.watts[light] = watts;
+    }
+}
+
+// Fraction of full power (Q15) the light is delivering at its committed level
+static uint16_t Power_Fraction(uint8_t num)
+{
+    uint8_t level = dim_trans_buf[num];
+    uint16_t half_cycle = half_cycle_ticks ? half_cycle_ticks : Calc_Dim_CCR(0);   // Nominal until one is measured
+    uint32_t pos;
+    uint16_t index;
+    uint16_t step;
+
+    if(level <= AC_DIM_MIN_PERCENT)
+    {
+        return 0;
+    }
+    if(level >= AC_DIM_MAX_PERCENT)
+    {
+        return 32768;               // Gate held through the zero cross
+    }
+    if(burst_mode[num])
+    {
+        return (uint16_t)(((uint32_t)level << 15) / 100);      // Whole cycles, level % of them
+    }
+
+    // Firing angle, in table steps (Q8)
+    pos = ((uint32_t)Calc_Dim_CCR(level) << 14) / half_cycle;
+    index = pos >> 8;
+    if(index >= POWER_TABLE_STEPS)
+    {
+        return 0;
+    }
+    step = power_table[index] - power_table[index + 1];
+    return power_table[index] - (uint16_t)((step * (pos & 0xFF)) >> 8);
+}
+
+/*
+ * Adds the energy since the last tick, called once a second
+ */
+void Energy_Tick(void)
+{
+    uint32_t now = tick_ms;
+    uint32_t elapsed_ms = now - last_tick_ms;
+    uint8_t i;
+
+    last_tick_ms = now;
+    for(i = 0; i < 3; i++)
+    {
+        uint32_t power_mw = (uint32_t)(((uint64_t)energy.watts[i] * Power_Fraction(i) * 1000) >> 15);
+        uint32_t mj = energy_mj[i] + (uint32_t)(((uint64_t)power_mw * elapsed_ms) / 1000);
+
+        energy.power_w[i] = (uint16_t)(power_mw / 1000);
+        energy.energy_mwh[i] += mj / 3600;
+        energy_mj[i] = (uint16_t)(mj % 3600);
+    }
+}
@@ -0,0 +1,40 @@
+#include "stm32f0xx.h"
+#include "flash.h"
+
+void Flash_Unlock(void)
+{
+    if(FLASH->CR & FLASH_CR_LOCK)
+    {
+        FLASH->KEYR = FLASH_FKEY1;
+        FLASH->KEYR = FLASH_FKEY2;
+    }
+}
+
+void Flash_Lock(void)
+{
+    FLASH->CR |= FLASH_CR_LOCK;
+}
+
+static void Flash_Wait(void)
+{
+    while(FLASH->SR & FLASH_SR_BSY);
+    FLASH->SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR;
+}
+
+// One half word, the address must be blank (or the data 0)
+void Flash_Program(uint32_t address, uint16_t data)
+{
+    FLASH->CR |= FLASH_CR_PG;
+    *(__IO uint16_t *)address = data;
+    Flash_Wait();
+    FLASH->CR &= ~FLASH_CR_PG;
+}
+
+void Flash_ErasePage(uint32_t address)
+{
+    FLASH->CR |= FLASH_CR_PER;
+    FLASH->AR = address;
+    FLASH->CR |= FLASH_CR_STRT;
+    Flash_Wait();
+    FLASH->CR &= ~FLASH_CR_PER;
+}
@@ -0,0 +1,176 @@
+#include "stm32f0xx.h"
+#include "main.h"
+#include "level_store.h"
+#include "energy.h"
+#include "flash.h"
+#include <string.h>
+
+// The F030 has no VBAT pin, so the RTC backup registers are lost with VDD. The levels are logged to flash instead:
+// each save programs one record into the next blank slot of the page (half word writes, no erase), and the
+// last good record is restored at boot. The page is only erased once it is getting full, at boot or in standby
+// (Level_Store_Compact).
+
+// A record has the level, mode, soft start step and groups of every light, so a burst heater comes back as one and
+// group frames still reach the lights they did. The lamp wattages and energy counts go with them, so the energy
+// estimate carries on over a power cut (less the last part of a mWh).
+#define RECORD_SIZE     32      // A multiple of 4, the blank check reads a word
+#define RECORD_GROUPS   7       // level 1 - 3, burst mode (bit per light), soft start step 1 - 3, groups 1 - 3, 0, 0
+#define RECORD_ENERGY   12      // energy 1 - 3 in mWh (4), LSB first
+#define RECORD_WATTS    24      // watts 1 - 3 (2), LSB first, 0, check
+#define RECORD_COUNT    (LEVEL_STORE_SIZE / RECORD_SIZE)
+#define RECORD_BLANK    0xFFFFFFFF
+#define COMPACT_SLOTS   (RECORD_COUNT * 3 / 4)  // Used slots that get the page erased, the rest are for dropouts
+                                                // until the next standby or boot
+
+static uint8_t saved[RECORD_SIZE - 1] = {0};   // Last record written (or loaded)
+static uint16_t next_slot = RECORD_COUNT;
+
+
+// A half written record (supply gone part way through, the check goes last) fails the check
+static uint8_t Record_Check(const uint8_t * record)
+{
+    uint8_t check = 0xA5;
+    uint8_t i;
+
+    for(i = 0; i < RECORD_SIZE - 1; i++)
+    {
+        check ^= record[i];
+    }
+    return check;
+}
+
+static uint8_t Record_Valid(const uint8_t * record)
+{
+    return (record[0] <= 100) && (record[1] <= 100) && (record[2] <= 100) && (record[3] <= 0x07) &&
+           (record[4] <= 100) && (record[5] <= 100) && (record[6] <= 100) && (record[10] == 0) &&
+           (record[11] == 0) && (record[30] == 0) && (record[RECORD_SIZE - 1] == Record_Check(record));
+}
+
+static void Record_Write(const uint8_t * record)
+{
+    uint32_t address = LEVEL_STORE_PAGE + next_slot * RECORD_SIZE;
+    uint8_t i;
+
+    Flash_Unlock();
+    for(i = 0; i < RECORD_SIZE - 2; i += 2)
+    {
+        Flash_Program(address + i, record[i] | (record[i + 1] << 8));
+    }
+    Flash_Program(address + i, record[i] | (Record_Check(record) << 8));
+    Flash_Lock();
+
+    memcpy(saved, record, sizeof(saved));
+    next_slot++;
+}
+
+// Erases the page (20 - 40ms, the flash stalls the core throughout) and starts it again with the last record
+static void Page_Restart(uint8_t keep)
+{
+    Flash_Unlock();
+    Flash_ErasePage(LEVEL_STORE_PAGE);
+    Flash_Lock();
+    next_slot = 0;
+    if(keep)
+    {
+        Record_Write(saved);
+    }
+}
+
+
+/*
+ * Restores the levels, modes, soft start steps, group masks and energy counts from the last save, returns 0 (and
+ * leaves them alone) if there is none. Call once at boot, after the timers are set up (for the modes).
+ */
+uint8_t Level_Store_Load(volatile uint8_t * level, uint8_t * groups)
+{
+    const uint8_t * record = (const uint8_t *)LEVEL_STORE_PAGE;
+    uint8_t found = 0;
+    uint16_t i;
+
+    for(i = 0; i < RECORD_COUNT; i++, record += RECORD_SIZE)
+    {
+        if(*(const uint32_t *)record == RECORD_BLANK)
+        {
+            break;
+        }
+        if(Record_Valid(record))
+        {
+            memcpy(saved, record, sizeof(saved));
+            found = 1;
+        }
+    }
+    next_slot = i;
+
+    // Getting full, start the page again with just the last record. Nothing is firing yet.
+    if(next_slot >= COMPACT_SLOTS)
+    {
+        Page_Restart(found);
+    }
+
+    if(found)
+    {
+        for(i = 0; i < 3; i++)
+        {
+            level[i] = saved[i];
+            Light_SetMode(i, (saved[3] & (1 << i)) ? LIGHT_MODE_BURST : LIGHT_MODE_PHASE);
+            Light_SetSoftStart(i, saved[4 + i]);
+            groups[i] = saved[RECORD_GROUPS + i];
+            energy.energy_mwh[i] = saved[RECORD_ENERGY + 4 * i] | (saved[RECORD_ENERGY + 4 * i + 1] << 8) |
+                                   (saved[RECORD_ENERGY + 4 * i + 2] << 16) |
+                                   ((uint32_t)saved[RECORD_ENERGY + 4 * i + 3] << 24);
+            energy.watts[i] = saved[RECORD_WATTS + 2 * i] | (saved[RECORD_WATTS + 2 * i + 1] << 8);
+        }
+    }
+    return found;
+}
+
+/*
+ * Logs the levels, modes, soft start steps, group masks and energy counts if they changed since the last save. About
+ * 1ms (16 half word writes), quick enough for the supply to hold up after the mains goes. Call with the interrupts
+ * that can also save held off.
+ */
+void Level_Store_Save(const volatile uint8_t * level, const uint8_t * groups)
+{
+    uint8_t record[RECORD_SIZE - 1];
+    uint8_t i;
+
+    record[3] = 0;
+    record[10] = 0;
+    record[11] = 0;
+    record[30] = 0;
+    for(i = 0; i < 3; i++)
+    {
+        uint32_t mwh = energy.energy_mwh[i];
+        uint16_t watts = energy.watts[i];
+
+        record[i] = level[i];
+        record[3] |= (Light_GetMode(i) == LIGHT_MODE_BURST) << i;
+        record[4 + i] = Light_GetSoftStart(i);
+        record[RECORD_GROUPS + i] = groups[i];
+        record[RECORD_ENERGY + 4 * i] = (uint8_t)mwh;
+        record[RECORD_ENERGY + 4 * i + 1] = (uint8_t)(mwh >> 8);
+        record[RECORD_ENERGY + 4 * i + 2] = (uint8_t)(mwh >> 16);
+        record[RECORD_ENERGY + 4 * i + 3] = (uint8_t)(mwh >> 24);
+        record[RECORD_WATTS + 2 * i] = (uint8_t)watts;
+        record[RECORD_WATTS + 2 * i + 1] = (uint8_t)(watts >> 8);
+    }
+    if(!memcmp(record, saved, sizeof(record)) || (next_slot >= RECORD_COUNT))
+    {
+        return;
+    }
+    Record_Write(record);
+}
+
+/*
+ * Erases the page once it is over COMPACT_SLOTS used, so a board that is never reset doesn't run out of slots. Call
+ * from standby with interrupts off, before saving (a save to a full page is dropped, and would take the energy counted
+ * since with it): every light is off by then, so a supply cut during the erase loses the modes, soft start steps,
+ * groups and energy counts, and levels that restore as off anyway.
+ */
+void Level_Store_Compact(void)
+{
+    if(next_slot >= COMPACT_SLOTS)
+    {
+        Page_Restart(1);
+    }
+}
@@ -1,10 +1,74 @@
 #include "stm32f0xx.h"
 #include "stm32f0xx_it.h"
 #include "main.h"
+#include "dimmer_fast.h"
+#include "schedule.h"
+#include "level_store.h"
+#include "meter.h"
+#include "energy.h"
+#include "thermal.h"
+#include "boot.h"
 
 #define COMMAND_HEADER  0xA0
 
+// Instead of a light number, the second byte of a frame can be one of these commands:
+#define CMD_LIGHT_GROUPS    0x20    // [0xA0, 0x20 + light, group_mask] the groups (bit 0 - 7) the light is in
+#define CMD_GROUP_LEVEL     0x50    // [0xA0, 0x50 + group (0 - 7), level] sets every light in the group
+#define CMD_ALL_LEVEL       0x5F    // [0xA0, 0x5F, level] sets every light of the dimmer (of every dimmer on RS-485
+                                    // when sent to SERIAL_BROADCAST_ADDRESS)
+#define CMD_REPORT          0x80    // [0xA0, 0x80, report] sends the report back on USART1 Tx (PA2)
+#define CMD_SET_TIME        0x81    // [0xA0, 0x81, hour, minute, second] sets the RTC (24 hour)
+#define CMD_SET_SCHEDULE    0x82    // [0xA0, 0x82, index, hour, minute, level 1, level 2, level 3, fade_s (2)]
+                                    // hour 0xFF disables the entry, level 0xFF leaves the light alone
+#define CMD_SYNC            0x83    // [0xA0, 0x83, x] restarts the half cycle count, as the frame comes in. On RS-485
+                                    // send it to SERIAL_BROADCAST_ADDRESS: every node takes the same frame, so they
+                                    // only differ by how long the main loop takes to get to it (well under a half
+                                    // cycle). Synced one at a time, each is a frame (4.6ms at 9600) behind the last
+#define CMD_DEFER           0x84    // [0xA0, 0x84, N] the next level frame (light, group or all) is held until half cycle
+                                    // N after the sync, so dimmers that got it at different times all change together
+#define CMD_SET_WATTAGE     0x85    // [0xA0, 0x85, light, watts (2)] lamp wattage for the energy estimate, 0 for none
+#define CMD_BOOT            BOOT_CMD    // [0xA0, 0x86, 0xB0] resets into the bootloader for a firmware update (boot.h)
+
+// Reports, sent as [0xA0, 0x80, report, data...], multi byte values LSB first
+#define REPORT_STANDBY      0x00    // standby entries (2), last and max wake to first firing latency in us (2 + 2)
+#define REPORT_FIRING       0x01    // per light: firings (2), min, mean and max firing error in TIM3 ticks (2 + 2 + 2),
+                                    // the stats start again after each read (needs FIRING_DIAGNOSTICS)
+#define REPORT_ISR_PROFILE  0x02    // gate firings (2), last and max cycles from TIM3 ISR entry to the gate write (2 + 2),
+                                    // the max starts again after each read (needs ISR_PROFILE)
+#define REPORT_MAINS        0x03    // mains dropouts since boot (2), mains lost now (1)
+#define REPORT_METER        0x04    // mains RMS in 0.1V (2), per light: load RMS in mA (2) and overcurrent cutoffs (2),
+                                    // all over the last half cycle
+#define REPORT_ENERGY       0x05    // per light: estimated power in W (2) and energy in mWh (4), which carries on over
+                                    // power cuts (saved with the levels at a dropout or standby)
+#define REPORT_THERMAL      0x06    // MCU temperature in 0.1C (2, signed), level cap (1), derating active (1)
+
+// Standby: with every light off the MCU sits in STOP until a falling edge on the Rx pin (PA3).
+// The byte whose start bit wakes it is lost, so the host sends a 0xFF preamble first (0x1FF in RS-485 mode,
+// which is address 0x7F, so no node can have that one).
+#define STANDBY_TIMEOUT_MS  50      // Back to STOP if no frame for us arrives this long after waking
+#define SERIAL_PAYLOAD_TIMEOUT_MS   20  // For the bytes after the frame of a longer command
+
+#ifdef SERIAL_RS485
+#if (SERIAL_NODE_ADDRESS == SERIAL_BROADCAST_ADDRESS) || (SERIAL_NODE_ADDRESS > 0x7E)
+#error "SERIAL_NODE_ADDRESS has to be 0x01 - 0x7E"
+#endif
+#define SERIAL_NO_ADDRESS   0xFF    // No address character since the last frame
+#endif
+
+extern volatile uint32_t tick_ms;
+extern volatile uint16_t standby_count;
+extern volatile uint16_t wake_latency_us;
+extern volatile uint16_t wake_latency_max_us;
+extern volatile uint8_t mains_lost;
+extern volatile uint16_t mains_dropouts;
+
 volatile uint8_t dim_buf[3] = {0};					// Actual Value to Reach
+uint8_t light_groups[3] = {0xFF, 0xFF, 0xFF};		// Group mask of each light, in every group until set
+static uint8_t defer_next = 0;						// Hold the next level frame...
+static uint8_t defer_half_cycle = 0;				// ...until this half cycle
+#ifdef SERIAL_RS485
+static uint8_t frame_address = SERIAL_NO_ADDRESS;	// Address of the frame coming in, from its address character
+#endif
 
 static void EXTI0_Config(void)
 {
@@ -41,6 +105,8 @@ static void EXTI0_Config(void)
     EXTI_InitStructure.EXTI_LineCmd = ENABLE;
     EXTI_Init(&EXTI_InitStructure);
 
+    Zero_Cross_Init();
+
     /* Enable and set EXTI0 Interrupt */
     NVIC_InitStructure.NVIC_IRQChannel = EXTI0_1_IRQn;
     NVIC_InitStructure.NVIC_IRQChannelPriority = 0x00;
@@ -63,6 +129,7 @@ static void TIM_Config(void)
     TIM_TimeBaseStructure.TIM_Period = 0xFFFF;     						// ARR
     TIM_TimeBaseStructure.TIM_Prescaler = AC_DIM_PRESCALER;		// PSC
     TIM_TimeBaseInit(TIM3, &TIM_TimeBaseStructure);
+    TIM_UpdateRequestConfig(TIM3, TIM_UpdateSource_Regular);  // Only an overflow is an update interrupt, not the restart at each zero cross
 
     /* Output Compare Timing Mode configuration: Channel1 */
     TIM_OCStructInit(&TIM_OCInitStructure);
@@ -84,13 +151,65 @@ static void TIM_Config(void)
     NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
     NVIC_Init(&NVIC_InitStructure);
 
-    /* TIM Interrupts enable */
-    TIM_ITConfig(TIM3, TIM_IT_CC1 | TIM_IT_CC2 | TIM_IT_CC3, ENABLE);
+    /* TIM Interrupts enable, the update (overflow) is a lost zero cross */
+    TIM_ClearITPendingBit(TIM3, TIM_IT_Update);
+    TIM_ITConfig(TIM3, TIM_IT_CC1 | TIM_IT_CC2 | TIM_IT_CC3 | TIM_IT_Update, ENABLE);
 
     /* TIM3 enable counter */
     TIM_Cmd(TIM3, ENABLE);
 }
 
+#ifdef FIRING_DIAGNOSTICS
+/*
+ * TIM1 CH1 - CH3 (PA8 - PA10) input capture the gates looped back from PA4 - PA6. Same prescaler as TIM3 and
+ * reset with it at the zero cross, so a capture reads straight against the compare value the gate was fired at.
+ */
+static void Firing_Capture_Config(void)
+{
+    TIM_TimeBaseInitTypeDef  TIM_TimeBaseStructure;
+    TIM_ICInitTypeDef  TIM_ICInitStructure;
+    GPIO_InitTypeDef GPIO_InitStructure;
+    NVIC_InitTypeDef NVIC_InitStructure;
+
+    RCC_APB2PeriphClockCmd(RCC_APB2Periph_TIM1, ENABLE);
+
+    GPIO_InitStructure.GPIO_Pin = GPIO_Pin_8 | GPIO_Pin_9 | GPIO_Pin_10;
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF;
+    GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;
+    GPIO_InitStructure.GPIO_OType = GPIO_OType_PP;
+    GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_DOWN;
+    GPIO_Init(GPIOA, &GPIO_InitStructure);
+    GPIO_PinAFConfig(GPIOA, GPIO_PinSource8, GPIO_AF_2);
+    GPIO_PinAFConfig(GPIOA, GPIO_PinSource9, GPIO_AF_2);
+    GPIO_PinAFConfig(GPIOA, GPIO_PinSource10, GPIO_AF_2);
+
+    TIM_TimeBaseStructInit(&TIM_TimeBaseStructure);
+    TIM_TimeBaseStructure.TIM_Period = 0xFFFF;
+    TIM_TimeBaseStructure.TIM_Prescaler = AC_DIM_PRESCALER;
+    TIM_TimeBaseInit(TIM1, &TIM_TimeBaseStructure);
+    TIM_UpdateRequestConfig(TIM1, TIM_UpdateSource_Regular);
+
+    TIM_ICStructInit(&TIM_ICInitStructure);
+    TIM_ICInitStructure.TIM_ICPolarity = TIM_ICPolarity_Rising;
+    TIM_ICInitStructure.TIM_ICSelection = TIM_ICSelection_DirectTI;
+    TIM_ICInitStructure.TIM_Channel = TIM_Channel_1;
+    TIM_ICInit(TIM1, &TIM_ICInitStructure);
+    TIM_ICInitStructure.TIM_Channel = TIM_Channel_2;
+    TIM_ICInit(TIM1, &TIM_ICInitStructure);
+    TIM_ICInitStructure.TIM_Channel = TIM_Channel_3;
+    TIM_ICInit(TIM1, &TIM_ICInitStructure);
+
+    // Below the zero cross and TIM3, the capture itself is latched in hardware
+    NVIC_InitStructure.NVIC_IRQChannel = TIM1_CC_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPriority = 1;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+
+    TIM_ITConfig(TIM1, TIM_IT_CC1 | TIM_IT_CC2 | TIM_IT_CC3, ENABLE);
+    TIM_Cmd(TIM1, ENABLE);
+}
+#endif
+
 void InitUSART1(void)
 {
     // USART peripheral initialization settings    
@@ -102,63 +221,455 @@ void InitUSART1(void)
     RCC_APB2PeriphClockCmd(RCC_APB2Periph_USART1, ENABLE);
      
     //Configure USART1 pins: Tx (PA2), Rx(PA3)
-    GPIO_InitStructure.GPIO_Pin = GPIO_Pin_3;
+    GPIO_InitStructure.GPIO_Pin = GPIO_Pin_2 | GPIO_Pin_3;
     GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;
     GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF;
     GPIO_InitStructure.GPIO_OType = GPIO_OType_PP;
     GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_UP;
+#ifdef SERIAL_RS485
+    GPIO_InitStructure.GPIO_Pin |= GPIO_Pin_12;     // DE
+#endif
     GPIO_Init(GPIOA, &GPIO_InitStructure);
  
     // configure GPIO pins with GPIO_Mode_AF before setting the AF config!
+    GPIO_PinAFConfig(GPIOA, GPIO_PinSource2, GPIO_AF_1);
     GPIO_PinAFConfig(GPIOA, GPIO_PinSource3, GPIO_AF_1);
+#ifdef SERIAL_RS485
+    GPIO_PinAFConfig(GPIOA, GPIO_PinSource12, GPIO_AF_1);
+#endif
      
     //Configure USART1 setting: ----------------------------
     USART_StructInit(&USART_InitStructure);         // default 8bit, 9600 baud, stopbit=1, parity=none, full duplex, no hardware flowcontrol
-    //USART_InitStructure.USART_BaudRate = 9600;    // set baudrate to 115k2
-    USART_InitStructure.USART_Mode = USART_Mode_Rx;
+    USART_InitStructure.USART_BaudRate = SERIAL_BAUD;
+    USART_InitStructure.USART_Mode = USART_Mode_Rx | USART_Mode_Tx;
+#ifdef SERIAL_RS485
+    USART_InitStructure.USART_WordLength = USART_WordLength_9b;    // 9th bit marks the address characters
+#endif
  
     USART_Init(USART1, &USART_InitStructure); // USART is disabled after calling the USART_Init function
+
+#ifdef SERIAL_RS485
+    // These can only be changed while the USART is disabled
+    USART_DECmd(USART1, ENABLE);
+    USART_DEPolarityConfig(USART1, USART_DEPolarity_High);
+    USART_SetDEAssertionTime(USART1, SERIAL_DE_TIME);
+    USART_SetDEDeassertionTime(USART1, SERIAL_DE_TIME);
+    // No mute mode: the USART can only match one address, and a frame to SERIAL_BROADCAST_ADDRESS has to get
+    // through too. The address characters are checked in Serial_GetCommand() instead.
+#endif
      
     USART_Cmd(USART1, ENABLE);
 }
 
-uint8_t Serial_GetCommand(uint8_t * buffer)
+#ifdef SERIAL_RS485
+// The frame coming in was sent to every node
+static uint8_t Serial_Broadcast(void)
+{
+    return frame_address == SERIAL_BROADCAST_ADDRESS;
+}
+#else
+#define Serial_Broadcast()      0
+#endif
+
+// Waits for a whole frame, returns 0 if timeout_ms (0 for never) runs out first
+uint8_t Serial_GetCommand(uint8_t * buffer, uint16_t timeout_ms)
 {
     int i = 0;
+    uint32_t start = tick_ms;
 
     memset(buffer, 0, 4); // reset the buffer
 
     while(i < 3)
     {
-        while (USART_GetFlagStatus(USART1, USART_FLAG_RXNE) == RESET);
-        buffer[i++] = USART_ReceiveData(USART1);
+        uint16_t data;
+
+        while (USART_GetFlagStatus(USART1, USART_FLAG_RXNE) == RESET)
+        {
+            if (timeout_ms && ((tick_ms - start) >= timeout_ms)){
+                return 0;
+            }
+        }
+        data = USART_ReceiveData(USART1);
+#ifdef SERIAL_RS485
+        if (data & SERIAL_ADDRESS_MARK){
+            frame_address = (uint8_t)(data & 0x7F);     // A new frame follows
+            i = 0;
+            continue;
+        }
+        if ((frame_address != SERIAL_NODE_ADDRESS) && !Serial_Broadcast()){
+            continue;   // Another dimmer's frame
+        }
+#endif
+        buffer[i++] = (uint8_t)data;
         if (buffer[0] != COMMAND_HEADER){
             i = 0;
         }
     }
+    return 1;
+}
+
+// The rest of a command longer than the 3 byte frame, returns 0 if it doesn't all arrive within timeout_ms
+uint8_t Serial_GetBytes(uint8_t * buffer, uint8_t len, uint16_t timeout_ms)
+{
+    uint32_t start = tick_ms;
+
+    while(len--)
+    {
+        uint16_t data;
+
+        while (USART_GetFlagStatus(USART1, USART_FLAG_RXNE) == RESET)
+        {
+            if ((tick_ms - start) >= timeout_ms){
+                return 0;
+            }
+        }
+        data = USART_ReceiveData(USART1);
+#ifdef SERIAL_RS485
+        if (data & SERIAL_ADDRESS_MARK){
+            frame_address = SERIAL_NO_ADDRESS;
+            return 0;   // Cut short by the next frame, which is lost too
+        }
+#endif
+        *buffer++ = (uint8_t)data;
+    }
+    return 1;
+}
+
+// Done with the frame
+void Serial_EndFrame(void)
+{
+#ifdef SERIAL_RS485
+    frame_address = SERIAL_NO_ADDRESS;      // Ignore the bus until we are addressed again
+#endif
+}
+
+void Serial_Send(const uint8_t * data, uint8_t len)
+{
+    while(len--)
+    {
+        while (USART_GetFlagStatus(USART1, USART_FLAG_TXE) == RESET);
+        USART_SendData(USART1, *data++);
+    }
+    while (USART_GetFlagStatus(USART1, USART_FLAG_TC) == RESET);    // Done before a STOP can cut it off
+}
+
+void Serial_SendReport(uint8_t report)
+{
+    uint8_t buf[27] = {COMMAND_HEADER, CMD_REPORT, report};
+    uint8_t len = 3;
+    int i;
+
+    switch (report)
+    {
+        case REPORT_STANDBY:
+            buf[len++] = (uint8_t)standby_count;
+            buf[len++] = (uint8_t)(standby_count >> 8);
+            buf[len++] = (uint8_t)wake_latency_us;
+            buf[len++] = (uint8_t)(wake_latency_us >> 8);
+            buf[len++] = (uint8_t)wake_latency_max_us;
+            buf[len++] = (uint8_t)(wake_latency_max_us >> 8);
+            break;
+        case REPORT_FIRING:
+            for(i = 0; i < 3; i++)
+            {
+                firing_stats_t stats;
+                int16_t mean;
+
+                __disable_irq();
+                stats = firing_stats[i];
+                memset((void *)&firing_stats[i], 0, sizeof(firing_stats[i]));
+                __enable_irq();
+
+                mean = stats.count ? (int16_t)(stats.sum / stats.count) : 0;
+                buf[len++] = (uint8_t)stats.count;
+                buf[len++] = (uint8_t)(stats.count >> 8);
+                buf[len++] = (uint8_t)stats.min;
+                buf[len++] = (uint8_t)((uint16_t)stats.min >> 8);
+                buf[len++] = (uint8_t)mean;
+                buf[len++] = (uint8_t)((uint16_t)mean >> 8);
+                buf[len++] = (uint8_t)stats.max;
+                buf[len++] = (uint8_t)((uint16_t)stats.max >> 8);
+            }
+            break;
+        case REPORT_METER:
+            buf[len++] = (uint8_t)meter.voltage_dv;
+            buf[len++] = (uint8_t)(meter.voltage_dv >> 8);
+            for(i = 0; i < 3; i++)
+            {
+                buf[len++] = (uint8_t)meter.current_ma[i];
+                buf[len++] = (uint8_t)(meter.current_ma[i] >> 8);
+                buf[len++] = (uint8_t)meter.trips[i];
+                buf[len++] = (uint8_t)(meter.trips[i] >> 8);
+            }
+            break;
+        case REPORT_ENERGY:
+            for(i = 0; i < 3; i++)
+            {
+                uint32_t mwh = energy.energy_mwh[i];
+
+                buf[len++] = (uint8_t)energy.power_w[i];
+                buf[len++] = (uint8_t)(energy.power_w[i] >> 8);
+                buf[len++] = (uint8_t)mwh;
+                buf[len++] = (uint8_t)(mwh >> 8);
+                buf[len++] = (uint8_t)(mwh >> 16);
+                buf[len++] = (uint8_t)(mwh >> 24);
+            }
+            break;
+        case REPORT_THERMAL:
+            buf[len++] = (uint8_t)thermal_temp_dc;
+            buf[len++] = (uint8_t)((uint16_t)thermal_temp_dc >> 8);
+            buf[len++] = level_cap;
+            buf[len++] = (level_cap < 100);
+            break;
+        case REPORT_MAINS:
+            buf[len++] = (uint8_t)mains_dropouts;
+            buf[len++] = (uint8_t)(mains_dropouts >> 8);
+            buf[len++] = mains_lost;
+            break;
+#ifdef ISR_PROFILE
+        case REPORT_ISR_PROFILE:
+            {
+                isr_profile_t profile;
+
+                __disable_irq();
+                profile = isr_profile;
+                isr_profile.max = 0;
+                __enable_irq();
+
+                buf[len++] = (uint8_t)profile.count;
+                buf[len++] = (uint8_t)(profile.count >> 8);
+                buf[len++] = (uint8_t)profile.last;
+                buf[len++] = (uint8_t)(profile.last >> 8);
+                buf[len++] = (uint8_t)profile.max;
+                buf[len++] = (uint8_t)(profile.max >> 8);
+            }
+            break;
+#endif
+        default: break;
+    }
+    Serial_Send(buf, len);
+}
+
+static void Serial_SetSchedule(uint8_t index)
+{
+    uint8_t buf[7];
+    schedule_entry_t entry;
+
+    if(!Serial_GetBytes(buf, sizeof(buf), SERIAL_PAYLOAD_TIMEOUT_MS)){
+        return;
+    }
+    entry.hour = buf[0];
+    entry.minute = buf[1];
+    entry.level[0] = buf[2];
+    entry.level[1] = buf[3];
+    entry.level[2] = buf[4];
+    entry.fade_s = buf[5] | (buf[6] << 8);
+    Schedule_SetEntry(index, &entry);
+}
+
+static void Serial_SetWattage(uint8_t light)
+{
+    uint8_t buf[2];
+
+    if(Serial_GetBytes(buf, sizeof(buf), SERIAL_PAYLOAD_TIMEOUT_MS)){
+        Energy_SetWatts(light, buf[0] | (buf[1] << 8));
+    }
+}
+
+static void Serial_SetTime(uint8_t hour)
+{
+    uint8_t buf[2];
+
+    if(Serial_GetBytes(buf, sizeof(buf), SERIAL_PAYLOAD_TIMEOUT_MS)){
+        Schedule_SetTime(hour, buf[0], buf[1]);
+    }
+}
+
+// Sets every light in the mask (bit per light), stopping their scheduled fades
+static void Set_Lights(uint8_t light_mask, uint8_t level)
+{
+    int i;
+
+    if(level > 100)
+    {
+        level = 100;
+    }
+
+    if(defer_next)
+    {
+        defer_next = 0;
+        if(Defer_Lights(light_mask, level, defer_half_cycle)){
+            return;
+        }
+        // No free slot, apply it now rather than lose it
+    }
+
+    for(i = 0; i < 3; i++)
+    {
+        if(light_mask & (1 << i))
+        {
+            Schedule_CancelFade(i);
+            Light_SetLevel(i, level);
+        }
+    }
+}
+
+static uint8_t Group_Lights(uint8_t group)
+{
+    uint8_t light_mask = 0;
+    int i;
+
+    for(i = 0; i < 3; i++)
+    {
+        if(light_groups[i] & (1 << group)){
+            light_mask |= 1 << i;
+        }
+    }
+    return light_mask;
+}
+
+static uint8_t All_Lights_Off(void)
+{
+    int i;
+
+    for(i = 0; i < 3; i++)
+    {
+        if(light_level[i] > AC_DIM_MIN_PERCENT){     // Not dim_buf, a thermal cutoff stays awake to cool down
+            return 0;
+        }
+    }
+    // STOP masks the zero cross, a deferred turn on would miss its half cycle and a fade (from off) wouldn't move
+    return !Defer_Pending() && !Schedule_Fading();
+}
+
+/*
+ * STOP mode until the next frame. The USART can't wake the F030 from STOP, so the Rx pin is watched by EXTI3
+ * instead (EXTI2_3_IRQHandler unmasks the zero cross again). The zero cross is masked while stopped.
+ */
+static void Standby(void)
+{
+    EXTI_InitTypeDef EXTI_InitStructure;
+
+    __disable_irq();
+    Standby_Prepare();                              // Gates off, zero cross masked
+    Level_Store_Compact();                          // Page erase while nothing is firing
+    Level_Store_Save(light_level, light_groups);    // A power cut in standby mustn't bring back older levels
+    Meter_Stop();
+    SYSCFG_EXTILineConfig(EXTI_PortSourceGPIOA, EXTI_PinSource3);
+    EXTI_InitStructure.EXTI_Line = EXTI_Line3;
+    EXTI_InitStructure.EXTI_Mode = EXTI_Mode_Interrupt;
+    EXTI_InitStructure.EXTI_Trigger = EXTI_Trigger_Falling;     // Start bit
+    EXTI_InitStructure.EXTI_LineCmd = ENABLE;
+    EXTI_Init(&EXTI_InitStructure);
+    EXTI_ClearITPendingBit(EXTI_Line3);
+    NVIC_EnableIRQ(EXTI2_3_IRQn);
+
+    // Low power regulator STOP, the HSI is still the system clock when it wakes. Interrupts stay off through the
+    // WFI: a wake up that comes before it is left pending and returns it straight away instead of being lost, and the
+    // handler runs once they are back on.
+    PWR->CR = (PWR->CR & ~PWR_CR_PDDS) | PWR_CR_LPDS;
+    SCB->SCR |= SCB_SCR_SLEEPDEEP_Msk;
+    __WFI();
+    SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;
+    __enable_irq();
+    Standby_Resume();
+    Meter_Start();
+
+    // The byte the wake up cut into is garbage
+    USART_ClearFlag(USART1, USART_FLAG_ORE | USART_FLAG_FE | USART_FLAG_NE);
+}
+
+/*
+ * Resets into the bootloader. The lights are off through the update and come back at their levels afterwards.
+ */
+static void Boot_Enter(uint8_t key)
+{
+    if(key != BOOT_CMD_KEY)
+    {
+        return;
+    }
+    __disable_irq();
+    GPIO_ResetBits(GPIOA, GPIO_Pin_4 | GPIO_Pin_5 | GPIO_Pin_6);
+    Level_Store_Save(light_level, light_groups);
+    BOOT_REQUEST = BOOT_REQUEST_KEY;
+    NVIC_SystemReset();
 }
 
 int main (void)
 {
+    int i;
+
     EXTI0_Config();
     TIM_Config();
+#ifdef FIRING_DIAGNOSTICS
+    Firing_Capture_Config();
+#endif
+    if(Level_Store_Load(light_level, light_groups)) // Back on as they were before a power cut
+    {
+        for(i = 0; i < 3; i++)
+        {
+            Light_SetLevel(i, light_level[i]);
+        }
+    }
     InitUSART1();
+    RCC_APB1PeriphClockCmd(RCC_APB1Periph_PWR, ENABLE);
+    SysTick_Config(SystemCoreClock / 1000);         // tick_ms
+    Schedule_Init();
+    Meter_Init();
+    Thermal_Init();
 
     while(1)
     {
         uint8_t buf[4] = {0};
+        uint16_t timeout_ms = 0;
 
-        Serial_GetCommand(&buf[0]);
+        if(All_Lights_Off())
+        {
+            Standby();
+            timeout_ms = STANDBY_TIMEOUT_MS;
+        }
+
+        if(!Serial_GetCommand(&buf[0], timeout_ms)){
+            continue;   // Woken by traffic that wasn't for us
+        }
 
         if(buf[0] == COMMAND_HEADER)	// header
         {
             switch (buf[1])
             {
-                case 0: dim_buf[0] = buf[2]; break;	// Light 1
-                case 1: dim_buf[1] = buf[2]; break;	// Light 2
-                case 2: dim_buf[2] = buf[2]; break;	// Light 3
+                case 0:										// Light 1 - 3, stops a scheduled fade
+                case 1:
+                case 2: Set_Lights(1 << buf[1], buf[2]); break;
+                case 0x10:									// Light 1 - 3 mode
+                case 0x11:
+                case 0x12: Light_SetMode(buf[1] & 0x0F, buf[2]); break;
+                case 0x20:									// Light 1 - 3 groups
+                case 0x21:
+                case 0x22: light_groups[buf[1] & 0x0F] = buf[2]; break;
+                case 0x30:									// Light 1 - 3 soft start step
+                case 0x31:
+                case 0x32: Light_SetSoftStart(buf[1] & 0x0F, buf[2]); break;
+                case 0x50: case 0x51: case 0x52: case 0x53:	// Group 0 - 7 level
+                case 0x54: case 0x55: case 0x56: case 0x57: Set_Lights(Group_Lights(buf[1] & 0x07), buf[2]); break;
+                case CMD_ALL_LEVEL: Set_Lights(0x07, buf[2]); break;
+                case CMD_REPORT:                            // Every node would answer at once
+                    if(!Serial_Broadcast()){
+                        Serial_SendReport(buf[2]);
+                    }
+                    break;
+                case CMD_SYNC: half_cycle_count = 0; break;
+                case CMD_DEFER: defer_half_cycle = buf[2]; defer_next = 1; break;
+                case CMD_SET_TIME: Serial_SetTime(buf[2]); break;
+                case CMD_SET_SCHEDULE: Serial_SetSchedule(buf[2]); break;
+                case CMD_SET_WATTAGE: Serial_SetWattage(buf[2]); break;
+                case CMD_BOOT:                              // Updates are one dimmer at a time
+                    if(!Serial_Broadcast()){
+                        Boot_Enter(buf[2]);
+                    }
+                    break;
                 default: break;
             }
         }
+        Serial_EndFrame();
     }
 }
@@ -0,0 +1,280 @@
+#include "stm32f0xx.h"
+#include "main.h"
+#include "meter.h"
+#include "schedule.h"
+#include <string.h>
+
+/*
+ * Load metering. The ADC scans the four inputs continuously and DMA writes them into a circular buffer, so no
+ * interrupt is taken per sample. Each half of the buffer (METER_SCANS / 2 scans, ~1.3ms) is summed (and squared) in
+ * DMA1_Channel1_IRQHandler, below the priority of the gate interrupts.
+ * The zero cross only notes where the DMA had got to, the block holding it is split there so every half cycle
+ * gets exactly its own samples. The RMS is worked out once a half cycle in fixed point.
+ * No StdPeriph ADC or DMA driver in the project, the registers are driven directly.
+ */
+
+#define METER_CHANNELS      5           // Scan order (ascending channel): voltage, light 1, light 2, light 3, temperature
+#define METER_INPUTS        4           // The ones metered, the temperature is only read by the thermal derating
+#define METER_SCANS         8
+#define METER_BUF_LEN       (METER_CHANNELS * METER_SCANS)
+#define METER_SAMPLES_MAX   255         // Per half cycle, keeps the sum of squares in 32 bits (50Hz is ~32)
+#define METER_READY_MS      5           // ADC calibration and start up, both take a few us
+
+typedef struct{
+    uint32_t sum[METER_INPUTS];
+    uint32_t sum_sq[METER_INPUTS];
+    uint8_t count;
+}meter_acc_t;
+
+volatile meter_t meter;
+
+static volatile uint16_t meter_buf[METER_BUF_LEN];
+static meter_acc_t acc;                 // The half cycle being sampled
+static meter_acc_t last;                // The one before, for the offset
+static volatile uint8_t zc_pos = 0;     // Buffer index of the first sample after the zero cross
+static volatile uint8_t zc_pending = 0;
+static uint8_t over_count[3];
+static uint8_t meter_on = 0;            // Cleared if the ADC never came up, metering (and the temperature) stays off
+
+extern volatile uint32_t tick_ms;
+
+
+// Waits for the ADC, returns 0 if it doesn't get there in METER_READY_MS
+static uint8_t Adc_Wait(volatile uint32_t * reg, uint32_t mask, uint32_t value)
+{
+    uint32_t start = tick_ms;
+
+    while((*reg & mask) != value)
+    {
+        if((tick_ms - start) >= METER_READY_MS){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+void Meter_Init(void)
+{
+    NVIC_InitTypeDef NVIC_InitStructure;
+
+    RCC->AHBENR |= RCC_AHBENR_GPIOAEN | RCC_AHBENR_GPIOBEN | RCC_AHBENR_DMA1EN;
+    RCC->APB2ENR |= RCC_APB2ENR_ADC1EN;
+
+    // Analog inputs
+    GPIOA->MODER |= GPIO_MODER_MODER1 | GPIO_MODER_MODER7;
+    GPIOB->MODER |= GPIO_MODER_MODER0 | GPIO_MODER_MODER1;
+
+    // PCLK / 2 = 4MHz, 239.5 + 12.5 cycles a conversion: a scan every 315us
+    ADC1->CFGR2 = ADC_CFGR2_CKMODE_0;
+    ADC1->CR |= ADC_CR_ADCAL;
+    if(!Adc_Wait(&ADC1->CR, ADC_CR_ADCAL, 0))
+    {
+        return;
+    }
+    ADC->CCR |= ADC_CCR_TSEN;
+    ADC1->CHSELR = ADC_CHSELR_CHSEL1 | ADC_CHSELR_CHSEL7 | ADC_CHSELR_CHSEL8 | ADC_CHSELR_CHSEL9 | ADC_CHSELR_CHSEL16;
+    ADC1->SMPR = ADC_SMPR_SMP;
+    ADC1->CFGR1 = ADC_CFGR1_CONT | ADC_CFGR1_DMAEN | ADC_CFGR1_DMACFG;     // 12 bit, circular DMA
+
+    DMA1_Channel1->CPAR = (uint32_t)&ADC1->DR;
+    DMA1_Channel1->CMAR = (uint32_t)meter_buf;
+    DMA1_Channel1->CNDTR = METER_BUF_LEN;
+    DMA1_Channel1->CCR = DMA_CCR_MINC | DMA_CCR_MSIZE_0 | DMA_CCR_PSIZE_0 | DMA_CCR_CIRC | DMA_CCR_HTIE | DMA_CCR_TCIE;
+
+    ADC1->ISR = ADC_ISR_ADRDY;
+    ADC1->CR |= ADC_CR_ADEN;
+    if(!Adc_Wait(&ADC1->ISR, ADC_ISR_ADRDY, ADC_ISR_ADRDY))
+    {
+        return;
+    }
+
+    DMA1_Channel1->CCR |= DMA_CCR_EN;
+
+    NVIC_InitStructure.NVIC_IRQChannel = DMA1_Channel1_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPriority = 2;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+
+    meter_on = 1;
+    ADC1->CR |= ADC_CR_ADSTART;
+}
+
+uint8_t Meter_Running(void)
+{
+    return meter_on;
+}
+
+// Before STOP, the scan would be cut off part way
+void Meter_Stop(void)
+{
+    if(!meter_on)
+    {
+        return;
+    }
+    ADC1->CR |= ADC_CR_ADSTP;
+    while(ADC1->CR & ADC_CR_ADSTP);
+}
+
+void Meter_Start(void)
+{
+    if(meter_on)
+    {
+        ADC1->CR |= ADC_CR_ADSTART;
+    }
+}
+
+/*
+ * Mean of the temperature sensor readings in the buffer (the last METER_SCANS scans)
+ */
+uint16_t Meter_TemperatureRaw(void)
+{
+    uint32_t sum = 0;
+    uint8_t i;
+
+    for(i = METER_CHANNELS - 1; i < METER_BUF_LEN; i += METER_CHANNELS)
+    {
+        sum += meter_buf[i];
+    }
+    return (uint16_t)(sum / METER_SCANS);
+}
+
+/*
+ * Called at the zero cross, notes the scan the DMA is on (rounded back to the start of it)
+ */
+void Meter_ZeroCross(void)
+{
+    uint8_t pos = METER_BUF_LEN - DMA1_Channel1->CNDTR;
+
+    zc_pos = pos - (pos % METER_CHANNELS);
+    zc_pending = 1;
+}
+
+static uint32_t Isqrt(uint32_t x)
+{
+    uint32_t root = 0;
+    uint32_t bit = 1UL << 30;
+
+    while(bit > x)
+    {
+        bit >>= 2;
+    }
+    while(bit)
+    {
+        if(x >= root + bit)
+        {
+            x -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else
+        {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return root;
+}
+
+/*
+ * RMS of one input over the half cycle, in ADC counts (Q4). The bias is the mean over the last two half cycles
+ * (one of each polarity), a half cycle on its own averages to the bias plus the mean of one lobe.
+ */
+static uint32_t Rms_Q4(uint8_t ch)
+{
+    uint32_t n = acc.count;
+    int64_t offset_q8 = (((int64_t)acc.sum[ch] + last.sum[ch]) << 8) / (n + last.count);
+    int64_t ms_q16;
+
+    ms_q16 = (((int64_t)acc.sum_sq[ch] << 16) - 2 * offset_q8 * ((int64_t)acc.sum[ch] << 8)) / n
+             + offset_q8 * offset_q8;
+    if(ms_q16 <= 0)
+    {
+        return 0;
+    }
+    return Isqrt((uint32_t)(ms_q16 >> 8));
+}
+
+static uint16_t Scale(uint32_t rms_q4, uint32_t per_count_q8)
+{
+    uint32_t value = (rms_q4 * per_count_q8) >> 12;
+
+    return (value > 0xFFFF) ? 0xFFFF : (uint16_t)value;
+}
+
+// End of a half cycle: RMS of every input, and the overcurrent check
+static void Meter_HalfCycle(void)
+{
+    uint8_t i;
+
+    if(acc.count && last.count)
+    {
+        meter.voltage_dv = Scale(Rms_Q4(0), METER_VOLTAGE_DV_PER_COUNT_Q8);
+        for(i = 0; i < 3; i++)
+        {
+            uint16_t current = Scale(Rms_Q4(i + 1), METER_CURRENT_MA_PER_COUNT_Q8);
+
+            meter.current_ma[i] = current;
+            if(current <= METER_OVERCURRENT_MA)
+            {
+                over_count[i] = 0;
+            }
+            else if(++over_count[i] >= METER_TRIP_HALF_CYCLES)
+            {
+                over_count[i] = 0;
+                Schedule_CancelFade(i);
+                Light_SetLevel(i, 0);       // Off from the next half cycle, a new level turns it back on
+                if(meter.trips[i] < 0xFFFF)
+                {
+                    meter.trips[i]++;
+                }
+            }
+        }
+    }
+
+    last = acc;
+    memset(&acc, 0, sizeof(acc));
+}
+
+static void Meter_Add(uint8_t from, uint8_t to)
+{
+    uint8_t i, ch;
+
+    for(i = from; i < to; i += METER_CHANNELS)
+    {
+        if(acc.count >= METER_SAMPLES_MAX)
+        {
+            return;                         // No zero cross (mains lost), the sums would overflow
+        }
+        for(ch = 0; ch < METER_INPUTS; ch++)
+        {
+            uint32_t sample = meter_buf[i + ch];
+
+            acc.sum[ch] += sample;
+            acc.sum_sq[ch] += sample * sample;
+        }
+        acc.count++;
+    }
+}
+
+/**
+  * @brief  This function handles the DMA half and full transfer interrupts, a block of scans each.
+  * @param  None
+  * @retval None
+  */
+void DMA1_Channel1_IRQHandler(void)
+{
+    uint8_t from = (DMA1->ISR & DMA_ISR_HTIF1) ? 0 : METER_BUF_LEN / 2;
+    uint8_t to = from + METER_BUF_LEN / 2;
+
+    DMA1->IFCR = DMA_IFCR_CGIF1;
+
+    // The zero cross can land in the block being filled while this one is summed, it waits for the next
+    if(zc_pending && (zc_pos >= from) && (zc_pos < to))
+    {
+        zc_pending = 0;
+        Meter_Add(from, zc_pos);
+        Meter_HalfCycle();
+        from = zc_pos;
+    }
+    Meter_Add(from, to);
+}
@@ -0,0 +1,276 @@
+#include "stm32f0xx.h"
+#include "main.h"
+#include "schedule.h"
+
+// The board has no 32kHz crystal, so the RTC runs from the LSI (~40kHz, +-50% over temperature and parts). It is
+// trimmed against the mains instead: the half cycles counted over SCHEDULE_TRIM_S calendar seconds give the length of
+// its second, and the synchronous prescaler is set from that. SCHEDULE_LSI_HZ is only where it starts.
+#define SCHEDULE_LSI_HZ         40000
+#define RTC_ASYNCH_PREDIV       3       // Low, so a step of the synchronous prescaler is ~0.01%
+#define RTC_SYNCH_PREDIV        ((SCHEDULE_LSI_HZ / (RTC_ASYNCH_PREDIV + 1)) - 1)  // 1Hz calendar
+#define SCHEDULE_NO_MINUTE      0xFFFF
+#define SCHEDULE_TRIM_S         256     // 25600 half cycles at 50Hz, the mains frequency averages out over it
+
+// A fade steps the level by one at a time from the zero cross, spread evenly over its half cycles
+typedef struct{
+    uint8_t level;
+    uint8_t target;
+    uint8_t steps;          // Levels from the start to the target
+    uint32_t half_cycles;   // Length of the fade, 0 when none is running
+    uint32_t error;
+}fade_t;
+
+
+static schedule_entry_t schedule[SCHEDULE_ENTRIES];
+static volatile fade_t fade[3];
+static uint16_t last_minute = SCHEDULE_NO_MINUTE;    // hour * 60 + minute the entries were last checked for
+
+static uint16_t synch_prediv = RTC_SYNCH_PREDIV;
+static volatile uint32_t mains_half_cycles = 0;     // Zero crosses the light timing locked onto
+static volatile uint8_t trim_valid = 0;             // Cleared when a zero cross could have gone uncounted
+static uint32_t trim_start = 0;                     // mains_half_cycles when the trim window started
+static uint16_t trim_seconds = 0;
+
+
+/*
+ * RTC from the LSI with Alarm A firing every second (all fields masked), it wakes the MCU from STOP too.
+ * The F030 has no RTC wakeup timer, the per second alarm stands in for it.
+ */
+void Schedule_Init(void)
+{
+    RTC_InitTypeDef RTC_InitStructure;
+    RTC_AlarmTypeDef RTC_AlarmStructure;
+    EXTI_InitTypeDef EXTI_InitStructure;
+    NVIC_InitTypeDef NVIC_InitStructure;
+    int i;
+
+    for(i = 0; i < SCHEDULE_ENTRIES; i++)
+    {
+        schedule[i].hour = SCHEDULE_DISABLED;
+    }
+
+    // Backup domain write access (the PWR driver isn't part of the project)
+    RCC_APB1PeriphClockCmd(RCC_APB1Periph_PWR, ENABLE);
+    PWR->CR |= PWR_CR_DBP;
+
+    RCC_LSICmd(ENABLE);
+    while(RCC_GetFlagStatus(RCC_FLAG_LSIRDY) == RESET);
+    RCC_RTCCLKConfig(RCC_RTCCLKSource_LSI);
+    RCC_RTCCLKCmd(ENABLE);
+    RTC_WaitForSynchro();
+
+    RTC_StructInit(&RTC_InitStructure);
+    RTC_InitStructure.RTC_HourFormat = RTC_HourFormat_24;
+    RTC_InitStructure.RTC_AsynchPrediv = RTC_ASYNCH_PREDIV;
+    RTC_InitStructure.RTC_SynchPrediv = synch_prediv;
+    RTC_Init(&RTC_InitStructure);
+
+    RTC_AlarmCmd(RTC_Alarm_A, DISABLE);
+    RTC_AlarmStructInit(&RTC_AlarmStructure);
+    RTC_AlarmStructure.RTC_AlarmMask = RTC_AlarmMask_All;
+    RTC_SetAlarm(RTC_Format_BIN, RTC_Alarm_A, &RTC_AlarmStructure);
+    RTC_ITConfig(RTC_IT_ALRA, ENABLE);
+    RTC_ClearFlag(RTC_FLAG_ALRAF);
+    RTC_AlarmCmd(RTC_Alarm_A, ENABLE);
+
+    // The RTC alarm comes in on EXTI line 17
+    EXTI_ClearITPendingBit(EXTI_Line17);
+    EXTI_InitStructure.EXTI_Line = EXTI_Line17;
+    EXTI_InitStructure.EXTI_Mode = EXTI_Mode_Interrupt;
+    EXTI_InitStructure.EXTI_Trigger = EXTI_Trigger_Rising;
+    EXTI_InitStructure.EXTI_LineCmd = ENABLE;
+    EXTI_Init(&EXTI_InitStructure);
+
+    // Lowest priority, the fades can wait for the zero cross and the compares
+    NVIC_InitStructure.NVIC_IRQChannel = RTC_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPriority = 3;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+}
+
+void Schedule_SetTime(uint8_t hour, uint8_t minute, uint8_t second)
+{
+    RTC_TimeTypeDef RTC_TimeStructure;
+
+    RTC_TimeStructInit(&RTC_TimeStructure);
+    RTC_TimeStructure.RTC_Hours = hour;
+    RTC_TimeStructure.RTC_Minutes = minute;
+    RTC_TimeStructure.RTC_Seconds = second;
+    RTC_SetTime(RTC_Format_BIN, &RTC_TimeStructure);
+    last_minute = hour * 60 + minute;   // Entries for the minute it is set in have been missed
+}
+
+void Schedule_SetEntry(uint8_t index, const schedule_entry_t * entry)
+{
+    if(index < SCHEDULE_ENTRIES)
+    {
+        __disable_irq();
+        schedule[index] = *entry;
+        __enable_irq();
+    }
+}
+
+// A level from the host takes over from a running fade
+void Schedule_CancelFade(uint8_t light)
+{
+    if(light < 3)
+    {
+        fade[light].half_cycles = 0;
+    }
+}
+
+// Non zero while a fade runs, it needs the zero cross so the MCU stays out of STOP
+uint8_t Schedule_Fading(void)
+{
+    return (fade[0].half_cycles || fade[1].half_cycles || fade[2].half_cycles);
+}
+
+static void Start_Entry(const schedule_entry_t * entry)
+{
+    int i;
+
+    for(i = 0; i < 3; i++)
+    {
+        uint8_t start = light_level[i];
+        uint8_t target = entry->level[i];
+
+        if(target == SCHEDULE_KEEP){
+            continue;
+        }
+
+        if(entry->fade_s == 0)
+        {
+            fade[i].half_cycles = 0;
+            Light_SetLevel(i, target);
+        }
+        else
+        {
+            // The zero cross steps it, so it can't see a fade half set up
+            __disable_irq();
+            fade[i].level = start;
+            fade[i].target = target;
+            fade[i].steps = (target > start) ? (target - start) : (start - target);
+            fade[i].error = 0;
+            fade[i].half_cycles = (uint32_t)entry->fade_s * 2 * MAINS_HZ;
+            __enable_irq();
+        }
+    }
+}
+
+/*
+ * From the zero cross, each half cycle the light timing is locked onto: counts it for the RTC trim and steps the
+ * running fades. A fade of half_cycles takes steps levels, one each time steps adds up to another half_cycles
+ * (no divide in the zero cross).
+ */
+void Schedule_HalfCycle(void)
+{
+    int i;
+
+    mains_half_cycles++;
+
+    for(i = 0; i < 3; i++)
+    {
+        volatile fade_t * f = &fade[i];
+
+        if(f->half_cycles == 0){
+            continue;
+        }
+
+        f->error += f->steps;
+        if(f->error >= f->half_cycles)
+        {
+            f->error -= f->half_cycles;
+            f->level = (f->target > f->level) ? (f->level + 1) : (f->level - 1);
+            Light_SetLevel(i, f->level);
+        }
+        if(f->level == f->target)
+        {
+            f->half_cycles = 0;
+        }
+    }
+}
+
+/*
+ * Called when zero crosses go uncounted (STOP, mains dropout), the trim window they fall in is thrown away
+ */
+void Schedule_TrimRestart(void)
+{
+    trim_valid = 0;
+}
+
+/*
+ * Once a second: every SCHEDULE_TRIM_S calendar seconds the synchronous prescaler is scaled by the mains seconds that
+ * really went by. Run just after the calendar second rolled over, so re-initialising the prescalers loses next to
+ * nothing of it. The division is fine here, the RTC interrupt is the lowest priority.
+ */
+static void Trim_Calendar(void)
+{
+    uint32_t half_cycles;
+    uint32_t prediv;
+    RTC_InitTypeDef RTC_InitStructure;
+
+    if(++trim_seconds < SCHEDULE_TRIM_S){
+        return;
+    }
+    half_cycles = mains_half_cycles - trim_start;
+    trim_start += half_cycles;
+    trim_seconds = 0;
+    if(!trim_valid || (half_cycles == 0))
+    {
+        trim_valid = 1;                 // The next window starts now
+        return;
+    }
+
+    prediv = ((uint32_t)(synch_prediv + 1) * SCHEDULE_TRIM_S * 2 * MAINS_HZ + half_cycles / 2) / half_cycles;
+    if((prediv < (RTC_SYNCH_PREDIV + 1) / 2) || (prediv > (RTC_SYNCH_PREDIV + 1) * 2) || (prediv == synch_prediv + 1)){
+        return;                         // Further out than the LSI goes (some half cycles weren't counted), or spot on
+    }
+
+    synch_prediv = prediv - 1;
+    RTC_StructInit(&RTC_InitStructure);
+    RTC_InitStructure.RTC_HourFormat = RTC_HourFormat_24;
+    RTC_InitStructure.RTC_AsynchPrediv = RTC_ASYNCH_PREDIV;
+    RTC_InitStructure.RTC_SynchPrediv = synch_prediv;
+    RTC_Init(&RTC_InitStructure);
+}
+
+/*
+ * Once a second from the RTC alarm: starts the entries due this minute and trims the calendar.
+ * The entries go on the change of minute, not on second 0, so a tick that is late or lost (the alarm woke it from
+ * STOP) can't skip one.
+ */
+void Schedule_Tick(void)
+{
+    RTC_TimeTypeDef now;
+    uint16_t minute;
+    int i;
+
+    // The shadow registers aren't updated in STOP, they have to be resynchronised (RSF) before they can be read
+    if(RTC_WaitForSynchro() == SUCCESS)
+    {
+        RTC_GetTime(RTC_Format_BIN, &now);
+        minute = now.RTC_Hours * 60 + now.RTC_Minutes;
+    }
+    else
+    {
+        minute = last_minute;           // Left for the next tick
+    }
+
+    if(last_minute == SCHEDULE_NO_MINUTE)
+    {
+        last_minute = minute;           // First tick after boot, the minute had started already
+    }
+    if(minute != last_minute)
+    {
+        last_minute = minute;
+        for(i = 0; i < SCHEDULE_ENTRIES; i++)
+        {
+            if((schedule[i].hour * 60 + schedule[i].minute) == minute)
+            {
+                Start_Entry(&schedule[i]);
+            }
+        }
+    }
+
+    Trim_Calendar();
+}
@@ -30,6 +30,11 @@
 /* Includes ------------------------------------------------------------------*/
 #include "stm32f0xx_it.h"
 #include "main.h"
+#include "dimmer_fast.h"
+#include "schedule.h"
+#include "level_store.h"
+#include "meter.h"
+#include "energy.h"
 
 /** @addtogroup STM32F0xx_StdPeriph_Examples
   * @{
@@ -52,12 +57,92 @@
 volatile uint8_t zero_cross[3] = {0};
 volatile uint8_t dim_trans_buf[3] = {0};		// The incremental fade value
 extern volatile uint8_t dim_buf[3];					// Actual Value to Reach
+volatile uint8_t light_level[3] = {0};			// Level asked for, dim_buf is this under the thermal cap
+volatile uint8_t level_cap = 100;
+
+static const uint16_t gate_pin[3] = {GPIO_Pin_4, GPIO_Pin_5, GPIO_Pin_6};
+static const uint16_t gate_it[3] = {TIM_IT_CC1, TIM_IT_CC2, TIM_IT_CC3};
+
+#if GATE_PULSE_US
+#define GATE_PULSE_EDGES    (2 * (GATE_RETRIGGER_PULSES + 1))   // On and off edges in each train
+#define US_TO_TICKS(us)     ((uint16_t)((us) * (SystemCoreClock / 1000000) / (AC_DIM_PRESCALER + 1)))
+
+volatile uint8_t gate_pulse_step[3] = {0};		// Edges of the pulse train done this half cycle (0 for none)
+static uint16_t gate_pulse_ticks;				// US_TO_TICKS(GATE_PULSE_US), worked out in Zero_Cross_Init()
+static uint16_t gate_retrigger_ticks;			// US_TO_TICKS(GATE_RETRIGGER_US)
+#endif
+
+// Calc_Dim_CCR() of every level, filled in by Zero_Cross_Init(). The ISRs only look the compare up, the M0 has no
+// divide instruction and Calc_Dim_CCR()'s 32 bit one is a library call of some hundred cycles.
+static uint16_t dim_ccr[101];
+
+#if (MAINS_HZ != 50) && (MAINS_HZ != 60)
+#error "MAINS_HZ has to be 50 or 60"
+#endif
+
+// A zero cross this soon after the last one is a bounce, 7/8 of the MAINS_HZ half cycle.
+// Relocking after a dropout takes an edge between the two as a half cycle after the one before. The windows at 50
+// and 60Hz don't overlap, so the wrong mains frequency never locks.
+// Worked out once by Zero_Cross_Init(), the M0 has no divide instruction.
+static uint16_t half_cycle_ticks_min;
+static uint16_t half_cycle_ticks_max;
+
+volatile uint32_t tick_ms = 0;					// SysTick, 1ms
+
+// Zero cross watchdog: no edge for a whole TIM3 period (65536 ticks, 24.6ms) is a dropout. Set until it relocks,
+// including at boot.
+volatile uint8_t mains_lost = 1;
+volatile uint16_t half_cycle_ticks = 0;			// Last whole half cycle measured, for the energy estimate
+volatile uint16_t mains_dropouts = 0;
+static uint8_t relock_edge = 0;					// Set once the first edge back has started the timing
+
+// Standby wake up, timed with TIM3 from the wake up to the first gate firing
+volatile uint16_t standby_count = 0;
+volatile uint16_t wake_latency_us = 0;			// Last wake up
+volatile uint16_t wake_latency_max_us = 0;
+static uint8_t wake_pending = 0;
+static uint32_t wake_ticks = 0;					// TIM3 ticks from the wake up to the last zero cross
+
+// Level changes held for a half cycle (counted from the last sync), so several dimmers change together
+#define DEFER_SLOTS     4
+
+typedef struct{
+    uint8_t half_cycle;
+    uint8_t light_mask;     // Bit per light, 0 for a free slot
+    uint8_t level;
+}deferred_t;
+
+volatile uint8_t half_cycle_count = 0;			// Zero crosses since the last sync
+static volatile deferred_t deferred[DEFER_SLOTS];
+
+#ifdef FIRING_DIAGNOSTICS
+// Compare value each light was fired at this half cycle, waiting for its TIM1 capture
+static const uint16_t capture_it[3] = {TIM_IT_CC1, TIM_IT_CC2, TIM_IT_CC3};
+static uint16_t fired_ccr[3];
+static uint8_t capture_pending = 0;				// Bit per light
+#endif
+volatile firing_stats_t firing_stats[3];
+
+#ifdef ISR_PROFILE
+volatile isr_profile_t isr_profile;
+volatile uint32_t isr_profile_start;
+#endif
+
+volatile uint8_t burst_mode[3] = {0};			// Set for lights in burst fire mode
+
+static uint8_t soft_start_step[3] = {SOFT_START_STEP, SOFT_START_STEP, SOFT_START_STEP};
+static uint8_t soft_start = 0;					// Bit per light, set while it ramps up from off
+static uint8_t burst_error[3] = {0};			// Error diffusion of the on cycles
+
+uint16_t Calc_Dim_CCR(uint32_t dim);
 
 void NMI_Handler(void){}
 void SVC_Handler(void){}
 void PendSV_Handler(void){}
-void SysTick_Handler(void){}
-void EXTI2_3_IRQHandler(void){}
+void SysTick_Handler(void)
+{
+    tick_ms++;
+}
 void EXTI4_15_IRQHandler(void){}
 void HardFault_Handler(void)
 {
@@ -75,6 +160,449 @@ void HardFault_Handler(void)
 /*  file (startup_stm32f0xx.s).                                               */
 /******************************************************************************/
 
+// First gate fired since the wake up, count is TIM3 at the firing point
+static void Wake_Fired(uint16_t count)
+{
+    uint32_t us = (wake_ticks + count) * (AC_DIM_PRESCALER + 1) / (SystemCoreClock / 1000000);
+
+    wake_pending = 0;
+    wake_latency_us = (us > 0xFFFF) ? 0xFFFF : (uint16_t)us;
+    if(wake_latency_us > wake_latency_max_us)
+    {
+        wake_latency_max_us = wake_latency_us;
+    }
+}
+
+static void Set_Compare(uint8_t num, uint16_t ccr)
+{
+    switch(num)
+    {
+        case 0: TIM_SetCompare1(TIM3, ccr); break;
+        case 1: TIM_SetCompare2(TIM3, ccr); break;
+        case 2: TIM_SetCompare3(TIM3, ccr); break;
+        default: break;
+    }
+}
+
+// Next step towards a new level, only a light coming on from off is held back (to soft_start_step a half cycle)
+static uint8_t Soft_Start(uint8_t num, uint8_t level)
+{
+    uint8_t now = dim_trans_buf[num];
+    uint16_t limit;
+
+    if(level <= now)
+    {
+        soft_start &= ~(1 << num);
+        return level;
+    }
+    if(now <= AC_DIM_MIN_PERCENT)
+    {
+        if(!soft_start_step[num])
+        {
+            return level;
+        }
+        soft_start |= 1 << num;
+        now = AC_DIM_MIN_PERCENT;
+    }
+    else if(!(soft_start & (1 << num)))
+    {
+        return level;               // Already on, not limited
+    }
+
+    limit = now + soft_start_step[num];
+    if(level <= limit)
+    {
+        soft_start &= ~(1 << num);  // Got there
+        return level;
+    }
+    return (uint8_t)limit;
+}
+
+// Loads the firing point for the next half cycle, picking up a new dim value if there is one
+static void Load_Light(uint8_t num)
+{
+#if GATE_PULSE_US
+    if(dim_trans_buf[num] != dim_buf[num])
+    {
+        dim_trans_buf[num] = Soft_Start(num, dim_buf[num]);
+    }
+    Set_Compare(num, dim_ccr[dim_trans_buf[num]]);
+#else
+    if(dim_trans_buf[num] != dim_buf[num])
+    {
+        dim_trans_buf[num] = Soft_Start(num, dim_buf[num]);
+        Set_Compare(num, dim_ccr[dim_trans_buf[num]]);
+    }
+#endif
+}
+
+#if GATE_PULSE_US
+// Timer ticks from the firing point to the next edge of the pulse train, odd steps are the ends of pulses
+static uint16_t Gate_Pulse_Offset(uint8_t step)
+{
+    uint16_t offset = (step / 2) * gate_retrigger_ticks;
+
+    if(step & 1)
+    {
+        offset += gate_pulse_ticks;
+    }
+    return offset;
+}
+
+// Stops a light's pulse train (if it has one) and puts its compare back on the firing point
+static void Gate_Pulse_End(uint8_t num)
+{
+    if(gate_pulse_step[num])
+    {
+        gate_pulse_step[num] = 0;
+        Load_Light(num);
+    }
+}
+
+// Next edge of a light's pulse train, the same compare channel is moved on to each edge in turn
+static void Gate_Pulse(uint8_t num)
+{
+    uint8_t step = gate_pulse_step[num];
+
+    if(step & 1)
+    {
+        Fast_GPIO_Reset(GPIOA, gate_pin[num]);
+    }
+    else
+    {
+        Fast_GPIO_Set(GPIOA, gate_pin[num]);
+    }
+
+    if(++step < GATE_PULSE_EDGES)
+    {
+        gate_pulse_step[num] = step;
+        Set_Compare(num, dim_ccr[dim_trans_buf[num]] + Gate_Pulse_Offset(step));
+    }
+    else
+    {
+        Gate_Pulse_End(num);
+    }
+}
+#endif
+
+// Output compare for one light: fires the gate after a zero cross and loads the next dim value
+static void Light_Compare(uint8_t num)
+{
+#if GATE_PULSE_US
+    if(gate_pulse_step[num])
+    {
+        Gate_Pulse(num);
+        return;
+    }
+#endif
+
+    if(zero_cross[num])
+    {
+        zero_cross[num] = 0;
+
+        if(dim_trans_buf[num] > AC_DIM_MIN_PERCENT)
+        {
+            Fast_GPIO_Set(GPIOA, gate_pin[num]);
+            Profile_Gate();
+            if(wake_pending)
+            {
+                Wake_Fired(Fast_TIM_GetCounter(TIM3));
+            }
+#ifdef FIRING_DIAGNOSTICS
+            fired_ccr[num] = dim_ccr[dim_trans_buf[num]];
+            capture_pending |= 1 << num;
+#endif
+#if GATE_PULSE_US
+            if(dim_trans_buf[num] < AC_DIM_MAX_PERCENT)
+            {
+                // Move on to the end of the pulse, the next dim value is picked up when the train ends
+                gate_pulse_step[num] = 1;
+                Set_Compare(num, dim_ccr[dim_trans_buf[num]] + Gate_Pulse_Offset(1));
+                return;
+            }
+#endif
+        }
+    }
+
+    Load_Light(num);
+}
+
+/*
+ * Burst fire, run at each zero cross. At the start of every full mains cycle the error diffusion decides which
+ * burst lights conduct for the whole cycle, so the on cycles are spread evenly and the load sees no DC.
+ * The gates are held through the cycle, a TRIAC fired at the zero cross switches at (near) zero volts.
+ */
+static void Burst_Zero_Cross(void)
+{
+    static uint8_t half_cycle = 0;
+    uint8_t i;
+
+    half_cycle ^= 1;
+    if(!half_cycle)
+    {
+        return;
+    }
+
+    for(i = 0; i < 3; i++)
+    {
+        uint8_t level = dim_buf[i];
+        uint8_t on;
+
+        if(!burst_mode[i])
+        {
+            continue;
+        }
+
+        if(level <= AC_DIM_MIN_PERCENT)
+        {
+            on = 0;
+        }
+        else if(level >= AC_DIM_MAX_PERCENT)
+        {
+            on = 1;
+        }
+        else
+        {
+            burst_error[i] += level;
+            on = (burst_error[i] >= 100);
+            if(on)
+            {
+                burst_error[i] -= 100;
+            }
+        }
+
+        if(on)
+        {
+            Fast_GPIO_Set(GPIOA, gate_pin[i]);
+            if(wake_pending)
+            {
+                Wake_Fired(0);
+            }
+        }
+        else
+        {
+            Fast_GPIO_Reset(GPIOA, gate_pin[i]);
+        }
+    }
+}
+
+/*
+ * Switches a light between phase angle (LIGHT_MODE_PHASE) and burst fire (LIGHT_MODE_BURST).
+ * A burst light gives up its TIM3 compare interrupt.
+ */
+void Light_SetMode(uint8_t num, uint8_t mode)
+{
+    if(num >= 3)
+    {
+        return;
+    }
+
+    __disable_irq();
+    if((mode == LIGHT_MODE_BURST) && !burst_mode[num])
+    {
+        TIM_ITConfig(TIM3, gate_it[num], DISABLE);
+        burst_mode[num] = 1;
+        burst_error[num] = 0;
+        zero_cross[num] = 0;
+#if GATE_PULSE_US
+        gate_pulse_step[num] = 0;
+#endif
+        Fast_GPIO_Reset(GPIOA, gate_pin[num]);
+    }
+    else if((mode != LIGHT_MODE_BURST) && burst_mode[num])
+    {
+        burst_mode[num] = 0;
+        Fast_GPIO_Reset(GPIOA, gate_pin[num]);
+        dim_trans_buf[num] = 0;                         // Comes on from off, through the soft start
+        dim_trans_buf[num] = Soft_Start(num, dim_buf[num]);
+        Set_Compare(num, dim_ccr[dim_trans_buf[num]]);
+        Fast_TIM_ClearIT(TIM3, gate_it[num]);
+        TIM_ITConfig(TIM3, gate_it[num], ENABLE);      // Fires from the next zero cross
+    }
+    __enable_irq();
+}
+
+uint8_t Light_GetMode(uint8_t num)
+{
+    return burst_mode[num] ? LIGHT_MODE_BURST : LIGHT_MODE_PHASE;
+}
+
+/*
+ * Every level change goes through here, so the thermal cap holds whatever set the level.
+ * Levels over 100 are taken as 100, the compare for each one is looked up in dim_ccr.
+ */
+void Light_SetLevel(uint8_t num, uint8_t level)
+{
+    uint8_t cap = level_cap;
+
+    if(level > 100)
+    {
+        level = 100;
+    }
+    light_level[num] = level;
+    dim_buf[num] = (level > cap) ? cap : level;
+}
+
+/*
+ * Highest level any light runs at, lights over it come down to it and go back up when it rises.
+ * Called every second by the thermal derating, which also puts right a Light_SetLevel() it cut into.
+ */
+void Light_SetCap(uint8_t cap)
+{
+    uint8_t i;
+
+    level_cap = (cap > 100) ? 100 : cap;
+    cap = level_cap;
+    for(i = 0; i < 3; i++)
+    {
+        dim_buf[i] = (light_level[i] > cap) ? cap : light_level[i];
+    }
+}
+
+/*
+ * Soft start step of a light (% a half cycle when it comes on from off), 0 for none
+ */
+void Light_SetSoftStart(uint8_t num, uint8_t step)
+{
+    if(num >= 3)
+    {
+        return;
+    }
+    soft_start_step[num] = (step > 100) ? 100 : step;
+}
+
+uint8_t Light_GetSoftStart(uint8_t num)
+{
+    return soft_start_step[num];
+}
+
+/*
+ * Queues a level change for the zero cross of half cycle N after the sync, returns 0 if there is no free slot
+ */
+uint8_t Defer_Lights(uint8_t light_mask, uint8_t level, uint8_t half_cycle)
+{
+    int i;
+
+    for(i = 0; i < DEFER_SLOTS; i++)
+    {
+        if(deferred[i].light_mask == 0)
+        {
+            deferred[i].half_cycle = half_cycle;
+            deferred[i].level = level;
+            deferred[i].light_mask = light_mask;       // Last, this makes the slot live
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// A queued change still waiting for its half cycle, the zero cross has to keep counting until it is applied
+uint8_t Defer_Pending(void)
+{
+    int i;
+
+    for(i = 0; i < DEFER_SLOTS; i++)
+    {
+        if(deferred[i].light_mask)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void Apply_Deferred(void)
+{
+    int i, j;
+
+    for(i = 0; i < DEFER_SLOTS; i++)
+    {
+        if(deferred[i].light_mask && (deferred[i].half_cycle == half_cycle_count))
+        {
+            for(j = 0; j < 3; j++)
+            {
+                if(deferred[i].light_mask & (1 << j))
+                {
+                    Schedule_CancelFade(j);
+                    Light_SetLevel(j, deferred[i].level);
+                }
+            }
+            deferred[i].light_mask = 0;
+        }
+    }
+}
+
+/*
+ * The zero cross has stopped: every gate off (TIM3 would carry on firing them from stale timing) and the levels saved
+ * while the supply still holds up
+ */
+static void Mains_Dropout(void)
+{
+    uint8_t i;
+
+    if(mains_lost)
+    {
+        relock_edge = 0;                // Still gone, an edge from before this is no timing reference
+        return;
+    }
+    mains_lost = 1;
+    relock_edge = 0;
+    Schedule_TrimRestart();
+    if(mains_dropouts < 0xFFFF)
+    {
+        mains_dropouts++;
+    }
+
+    for(i = 0; i < 3; i++)
+    {
+        zero_cross[i] = 0;              // So the debounce takes the first edge back
+#if GATE_PULSE_US
+        Gate_Pulse_End(i);
+#endif
+        Fast_GPIO_Reset(GPIOA, gate_pin[i]);
+    }
+    Level_Store_Save(light_level, light_groups);
+}
+
+/*
+ * Edge after a dropout (or at boot), returns 1 once locked. The first edge back only restarts TIM3, the next one
+ * a half cycle later locks and fires as normal, so the gates fire again from the second half cycle.
+ */
+static uint8_t Mains_Relock(void)
+{
+    uint16_t count = Fast_TIM_GetCounter(TIM3);
+
+    if(relock_edge && (count > half_cycle_ticks_min) && (count < half_cycle_ticks_max))
+    {
+        relock_edge = 0;
+        mains_lost = 0;
+        return 1;
+    }
+    relock_edge = 1;                    // First edge, or noise: timing from this one
+    return 0;
+}
+
+/*
+ * Called before the zero cross interrupt is enabled, and before any level is set
+ */
+void Zero_Cross_Init(void)
+{
+    uint16_t half_cycle = Calc_Dim_CCR(0);
+    uint8_t i;
+
+    for(i = 0; i <= 100; i++)
+    {
+        dim_ccr[i] = Calc_Dim_CCR(i);
+    }
+#if GATE_PULSE_US
+    gate_pulse_ticks = US_TO_TICKS(GATE_PULSE_US);
+    gate_retrigger_ticks = US_TO_TICKS(GATE_RETRIGGER_US);
+#endif
+
+    half_cycle_ticks_min = half_cycle - half_cycle / 8;
+    half_cycle_ticks_max = half_cycle + half_cycle / 8;
+}
+
 /**
   * @brief  This function handles External line 0 to 1 interrupt request.
   * @param  None
@@ -82,112 +610,221 @@ void HardFault_Handler(void)
   */
 void EXTI0_1_IRQHandler(void)
 {
-    if(EXTI_GetITStatus(EXTI_Line0) != RESET)
+    if(Fast_EXTI_GetITStatus(EXTI_Line0))
     {
         const uint8_t comp[3] = {0};
         if (!memcmp(zero_cross, comp, sizeof(comp)))
         {
-            // Zero Cross just happened
-            memset(zero_cross, 1, sizeof(zero_cross));
+            uint8_t i;
+            uint16_t count;
 
-            // Turn all TRIACs off if they shouldn't stay on
-            if(dim_trans_buf[0] < AC_DIM_MAX_PERCENT)
+            if(mains_lost && !Mains_Relock())
             {
-                GPIO_ResetBits(GPIOA, GPIO_Pin_4);
+                Fast_TIM_Restart(TIM3);
+                Fast_EXTI_ClearIT(EXTI_Line0);
+                return;
             }
-            if(dim_trans_buf[1] < AC_DIM_MAX_PERCENT)
+
+            if(wake_pending)
             {
-                GPIO_ResetBits(GPIOA, GPIO_Pin_5);
+                wake_ticks += Fast_TIM_GetCounter(TIM3);
             }
-            if(dim_trans_buf[2] < AC_DIM_MAX_PERCENT)
+
+            // Zero Cross just happened
+            for(i = 0; i < 3; i++)
             {
-                GPIO_ResetBits(GPIOA, GPIO_Pin_6);
+                // Burst lights have no compare to clear theirs, and drive their gates themselves
+                zero_cross[i] = !burst_mode[i];
+
+                // Turn TRIACs off if they shouldn't stay on
+                if(!burst_mode[i] && (dim_trans_buf[i] < AC_DIM_MAX_PERCENT))
+                {
+                    Fast_GPIO_Reset(GPIOA, gate_pin[i]);
+                }
             }
 
+            half_cycle_count++;
+            Apply_Deferred();
+            Schedule_HalfCycle();
+            Meter_ZeroCross();
+
+            // Only lights in phase mode hold off a bounce, so check the burst lights see a whole half cycle
+            count = Fast_TIM_GetCounter(TIM3);
+            if(count > half_cycle_ticks_min)
+            {
+                Burst_Zero_Cross();
+                if(count < half_cycle_ticks_max)
+                {
+                    half_cycle_ticks = count;
+                }
+            }
+
+#if GATE_PULSE_US
+            // Trains that ran into the zero cross (lights near full) need their compare back on the firing point
+            Gate_Pulse_End(0);
+            Gate_Pulse_End(1);
+            Gate_Pulse_End(2);
+#endif
+
             // Start the counter from 0 again
-            TIM_SetCounter(TIM3, 0);
+            Fast_TIM_Restart(TIM3);
+#ifdef FIRING_DIAGNOSTICS
+            Fast_TIM_Restart(TIM1);              // Same time base for the captures
+            capture_pending = 0;
+#endif
         }
 
         // Clear the EXTI line 0 pending bit
-        EXTI_ClearITPendingBit(EXTI_Line0);
+        Fast_EXTI_ClearIT(EXTI_Line0);
+    }
+}
+
+
+
+/*
+ * Called with interrupts off before STOP: all gates off and the zero cross masked, so only the Rx pin wakes it
+ */
+void Standby_Prepare(void)
+{
+    uint8_t i;
+
+    EXTI->IMR &= ~EXTI_Line0;
+    for(i = 0; i < 3; i++)
+    {
+        Fast_GPIO_Reset(GPIOA, gate_pin[i]);
+        zero_cross[i] = 0;              // The first zero cross after the wake up is taken straight away
+#if GATE_PULSE_US
+        gate_pulse_step[i] = 0;
+#endif
     }
+    wake_pending = 0;
+    standby_count++;
+    Schedule_TrimRestart();             // No zero crosses to count while stopped
 }
 
+/**
+  * @brief  This function handles External line 2 to 3 interrupt request, the wake up from standby.
+  * @param  None
+  * @retval None
+  */
+void EXTI2_3_IRQHandler(void)
+{
+    if(Fast_EXTI_GetITStatus(EXTI_Line3))
+    {
+        // Only needed for the wake up, the USART takes the Rx pin from here
+        EXTI->IMR &= ~EXTI_Line3;
+        Fast_EXTI_ClearIT(EXTI_Line3);
+
+        // Time to the first firing starts now
+        wake_ticks = 0;
+        wake_pending = 1;
+        Fast_TIM_Restart(TIM3);
+    }
+}
+
+/*
+ * Called after STOP, whatever woke it (Rx pin or RTC alarm): zero cross back on
+ */
+void Standby_Resume(void)
+{
+    EXTI->IMR &= ~EXTI_Line3;
+    Fast_EXTI_ClearIT(EXTI_Line0);
+    EXTI->IMR |= EXTI_Line0;
+}
+
+/**
+  * @brief  This function handles the RTC Alarm A interrupt, once a second.
+  * @param  None
+  * @retval None
+  */
+void RTC_IRQHandler(void)
+{
+    if(RTC_GetITStatus(RTC_IT_ALRA) != RESET)
+    {
+        RTC_ClearITPendingBit(RTC_IT_ALRA);
+        Fast_EXTI_ClearIT(EXTI_Line17);
+        Schedule_Tick();
+        Energy_Tick();
+    }
+}
 
 
 // Dim value between 0 (off) and 100 (max)
 uint16_t Calc_Dim_CCR(uint32_t dim)
 {
-    // 10ms is max brightness
-    //uint32_t t_cnt_ns = (AC_DIM_PRESCALER + 1) * 1000000000 / SystemCoreClock; // In ns
-    //return dim * 100000 / t_cnt_ns;
-    return ((100 - dim) * SystemCoreClock) / ((AC_DIM_PRESCALER + 1) * 10000);
+    // A whole half cycle (10ms at 50Hz) is max brightness
+    return ((100 - dim) * SystemCoreClock) / ((AC_DIM_PRESCALER + 1) * 100 * 2 * MAINS_HZ);
 }
 
 
 void TIM3_IRQHandler(void)
 {
-    // Output compare 1
-    if (TIM_GetITStatus(TIM3, TIM_IT_CC1) != RESET)
-    {
-        TIM_ClearITPendingBit(TIM3, TIM_IT_CC1);
+    uint8_t i;
 
-        if(zero_cross[0])
-        {
-            zero_cross[0] = 0;
+    Profile_Start();
 
-            if(dim_trans_buf[0] > AC_DIM_MIN_PERCENT)
-            {
-                GPIO_SetBits(GPIOA, GPIO_Pin_4);
-            }
-        }
-        if(dim_trans_buf[0] != dim_buf[0])
+    for(i = 0; i < 3; i++)
+    {
+        if (Fast_TIM_GetITStatus(TIM3, gate_it[i]))
         {
-            dim_trans_buf[0] = dim_buf[0];
-            TIM_SetCompare1(TIM3, Calc_Dim_CCR(dim_trans_buf[0]));
+            Fast_TIM_ClearIT(TIM3, gate_it[i]);
+            Light_Compare(i);
         }
     }
 
-    // Output compare 2
-    if (TIM_GetITStatus(TIM3, TIM_IT_CC2) != RESET)
+    // The zero cross keeps TIM3 from overflowing
+    if(Fast_TIM_GetITStatus(TIM3, TIM_IT_Update))
     {
-        TIM_ClearITPendingBit(TIM3, TIM_IT_CC2);
+        Fast_TIM_ClearIT(TIM3, TIM_IT_Update);
+        Mains_Dropout();
+    }
+}
+
+#ifdef FIRING_DIAGNOSTICS
+/*
+ * Gate rising edges looped back into TIM1, only the first edge after each firing is counted (not retrigger pulses)
+ */
+void TIM1_CC_IRQHandler(void)
+{
+    uint8_t i;
 
-        if(zero_cross[1])
+    for(i = 0; i < 3; i++)
+    {
+        if (Fast_TIM_GetITStatus(TIM1, capture_it[i]))
         {
-            zero_cross[1] = 0;
+            uint16_t capture;
+            int16_t error;
+            volatile firing_stats_t * stats = &firing_stats[i];
 
-            if(dim_trans_buf[1] > AC_DIM_MIN_PERCENT)
+            Fast_TIM_ClearIT(TIM1, capture_it[i]);
+            switch(i)
             {
-                GPIO_SetBits(GPIOA, GPIO_Pin_5);
+                case 0: capture = TIM_GetCapture1(TIM1); break;
+                case 1: capture = TIM_GetCapture2(TIM1); break;
+                default: capture = TIM_GetCapture3(TIM1); break;
             }
-        }
-        if(dim_trans_buf[1] != dim_buf[1])
-        {
-            dim_trans_buf[1] = dim_buf[1];
-            TIM_SetCompare2(TIM3, Calc_Dim_CCR(dim_trans_buf[1]));
-        }
-    }
 
-    // Output compare 3
-    if (TIM_GetITStatus(TIM3, TIM_IT_CC3) != RESET)
-    {
-        TIM_ClearITPendingBit(TIM3, TIM_IT_CC3);
-
-        if(zero_cross[2])
-        {
-            zero_cross[2] = 0;
+            if(!(capture_pending & (1 << i)))
+            {
+                continue;
+            }
+            capture_pending &= ~(1 << i);
 
-            if(dim_trans_buf[0] > AC_DIM_MIN_PERCENT)
+            error = (int16_t)(capture - fired_ccr[i]);
+            if((stats->count == 0) || (error < stats->min))
             {
-                GPIO_SetBits(GPIOA, GPIO_Pin_6);
+                stats->min = error;
+            }
+            if((stats->count == 0) || (error > stats->max))
+            {
+                stats->max = error;
+            }
+            stats->sum += error;
+            if(stats->count < 0xFFFF)
+            {
+                stats->count++;
             }
-        }
-        if(dim_trans_buf[2] != dim_buf[2])
-        {
-            dim_trans_buf[2] = dim_buf[2];
-            TIM_SetCompare3(TIM3, Calc_Dim_CCR(dim_trans_buf[2]));
         }
     }
 }
-
+#endif
@@ -0,0 +1,103 @@
+#include "stm32f0xx.h"
+#include "main.h"
+#include "thermal.h"
+#include "meter.h"
+
+/*
+ * Thermal derating, once a second from TIM14 so the zero cross and compare interrupts don't pay for it.
+ * The temperature sensor is scanned with the meter inputs, this only averages the readings already in the buffer.
+ * The F030 only has the 30C calibration point, the slope is the typical 4.3mV/C (5.34 counts a degree at 3.3V).
+ */
+
+#define TS_CAL1             (*(const uint16_t *)0x1FFFF7B8)     // Sensor reading at 30C, VDDA = 3.3V
+
+volatile int16_t thermal_temp_dc = 0;
+
+static uint8_t cutoff = 0;
+static uint8_t started = 0;
+
+
+void Thermal_Init(void)
+{
+    TIM_TimeBaseInitTypeDef TIM_TimeBaseStructure;
+    NVIC_InitTypeDef NVIC_InitStructure;
+
+    RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM14, ENABLE);
+
+    TIM_TimeBaseStructInit(&TIM_TimeBaseStructure);
+    TIM_TimeBaseStructure.TIM_Prescaler = SystemCoreClock / 1000 - 1;     // 1kHz
+    TIM_TimeBaseStructure.TIM_Period = 1000 - 1;                          // 1Hz
+    TIM_TimeBaseInit(TIM14, &TIM_TimeBaseStructure);
+
+    NVIC_InitStructure.NVIC_IRQChannel = TIM14_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPriority = 3;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+
+    TIM_ClearITPendingBit(TIM14, TIM_IT_Update);
+    TIM_ITConfig(TIM14, TIM_IT_Update, ENABLE);
+    TIM_Cmd(TIM14, ENABLE);
+}
+
+static int16_t Read_Temperature(void)
+{
+    int32_t counts = (int32_t)TS_CAL1 - Meter_TemperatureRaw();
+
+    return (int16_t)(300 + (counts * 33000) / 17613);   // 0.1C, 3300mV / 4096 / 4.3mV
+}
+
+// Highest level for the temperature (0.1C), 0 once cut off
+static uint8_t Derate_Cap(int16_t temp_dc)
+{
+    int32_t cap;
+
+    if(cutoff && (temp_dc >= (THERMAL_CUTOFF_C - THERMAL_HYSTERESIS_C) * 10))
+    {
+        return 0;
+    }
+    cutoff = 0;
+    if(temp_dc >= THERMAL_CUTOFF_C * 10)
+    {
+        cutoff = 1;
+        return 0;
+    }
+    if(temp_dc <= THERMAL_DERATE_C * 10)
+    {
+        return 100;
+    }
+
+    cap = 100 - ((temp_dc - THERMAL_DERATE_C * 10) * THERMAL_DERATE_PER_C) / 10;
+    return (cap < THERMAL_MIN_LEVEL) ? THERMAL_MIN_LEVEL : (uint8_t)cap;
+}
+
+/**
+  * @brief  This function handles the TIM14 update, once a second.
+  * @param  None
+  * @retval None
+  */
+void TIM14_IRQHandler(void)
+{
+    int16_t temp;
+
+    if(TIM_GetITStatus(TIM14, TIM_IT_Update) == RESET)
+    {
+        return;
+    }
+    TIM_ClearITPendingBit(TIM14, TIM_IT_Update);
+    if(!Meter_Running())
+    {
+        return;     // No ADC, no temperature to derate on
+    }
+
+    temp = Read_Temperature();
+    if(!started)
+    {
+        started = 1;
+        thermal_temp_dc = temp;
+    }
+    else
+    {
+        thermal_temp_dc += (temp - thermal_temp_dc) / 4;
+    }
+    Light_SetCap(Derate_Cap(thermal_temp_dc));
+}